@@ -0,0 +1,43 @@
+'use strict'
+/*
+  Compares filling a file one property at a time with a single
+  setMany() call. Run with `npm run bench`; pass a key count to
+  override the default, e.g. `node bench/set-many.js 1000000`.
+*/
+
+const binary = require('node-pre-gyp')
+const path = require('path')
+const mmap_obj_path = binary.find(path.resolve(path.join(__dirname, '../package.json')))
+const MmapObject = require(mmap_obj_path)
+const temp = require('temp')
+
+const count = parseInt(process.argv[2], 10) || 200000
+
+temp.track()
+const dir = temp.mkdirSync('mmap-object-bench')
+
+const data = {}
+for (let i = 0; i < count; i++) {
+  data[`key number ${i}`] = i % 3 ? `a value for key ${i}` : i
+}
+const keys = Object.keys(data)
+
+function time (name, fill) {
+  const obj = new MmapObject.Create(path.join(dir, name))
+  const start = process.hrtime()
+  fill(obj)
+  const [seconds, nanos] = process.hrtime(start)
+  const ms = seconds * 1e3 + nanos / 1e6
+  console.log(`${name}: ${count} keys in ${ms.toFixed(1)} ms (${Math.round(count / ms * 1000)} keys/s)`)
+  obj.close()
+}
+
+time('per-property', function (obj) {
+  for (let key of keys) {
+    obj[key] = data[key]
+  }
+})
+
+time('setMany', function (obj) {
+  obj.setMany(data)
+})
@@ -8,12 +8,41 @@
   #endif
 #endif
 #include <stdbool.h>
+#include <cmath>
+#include <cstdio>
+#include <cstddef>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#if !defined(_WIN32)
+#include <unistd.h>
+#include <signal.h>
+#endif
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#endif
+#if defined(_WIN32)
+#include <direct.h>
+#endif
 #include <boost/interprocess/managed_mapped_file.hpp>
+#include <boost/interprocess/file_mapping.hpp>
 #include <boost/interprocess/managed_shared_memory.hpp>
 #include <boost/interprocess/containers/string.hpp>
+#include <boost/interprocess/sync/interprocess_upgradable_mutex.hpp>
 #include <boost/unordered_map.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/utility/string_ref.hpp>
 #include <boost/version.hpp>
 #include <nan.h>
+#include <zlib.h> // Node's own copy.
 
 #if BOOST_VERSION < 105500
 #pragma message("Found boost version " BOOST_PP_STRINGIZE(BOOST_LIB_VERSION))
@@ -23,6 +52,11 @@
 #define MINIMUM_FILE_SIZE 500 // Minimum necessary to handle an mmap'd unordered_map on all platforms.
 #define DEFAULT_FILE_SIZE 5ul<<20 // 5 megs
 #define DEFAULT_MAX_SIZE 5000ul<<20 // 5000 megs
+#define DEFAULT_GROWTH_FACTOR 2.0 // Each grow at least doubles the file...
+#define DEFAULT_MIN_GROWTH 1ul<<20 // ...and adds at least a meg.
+#define INTERN_BUCKETS 64 // Starting size of the intern table.
+#define MIN_EXTERNAL_STRING 64 // Shorter values are cheaper to copy than to track.
+#define MAX_SHARDS 4096 // Files in one sharded set.
 
 // For Win32 compatibility
 #ifndef S_ISDIR
@@ -45,34 +79,191 @@ typedef SharedAllocator<char> char_allocator;
 typedef bip::basic_string<char, char_traits<char>, char_allocator> shared_string;
 typedef bip::basic_string<char, char_traits<char>> char_string;
 
+// Methods installed on the prototype of both Create and Open objects,
+// as (JS name, native implementation). This is the one list to touch
+// when adding a method: it drives the declarations in SharedMap, the
+// prototype set up in init_methods() and the isMethod() check.
+#define SHARED_MAP_METHODS(X)                   \
+  X("close", Close)                             \
+  X("freeze", freeze)                           \
+  X("flush", Flush)                             \
+  X("isClosed", isClosed)                       \
+  X("isOpen", isOpen)                           \
+  X("isData", isData)                           \
+  X("get_free_memory", get_free_memory)         \
+  X("get_size", get_size)                       \
+  X("bucket_count", bucket_count)               \
+  X("max_bucket_count", max_bucket_count)       \
+  X("load_factor", load_factor)                 \
+  X("max_load_factor", max_load_factor)         \
+  X("rehash", rehash)                           \
+  X("setMany", setMany)                         \
+  X("getMany", getMany)                         \
+  X("reserve", reserve)                         \
+  X("grow_count", grow_count)                   \
+  X("flushed_bytes", flushed_bytes)
+
+// Inherited names that must also resolve through the prototype chain
+// rather than the mapped data.
+#define RESERVED_NAMES(X)                       \
+  X("valueOf")                                  \
+  X("toString")
+
 #define UNINITIALIZED 0
 #define STRING_TYPE 1
 #define NUMBER_TYPE 2
+#define BOOLEAN_TYPE 3
+#define NULL_TYPE 4
+#define BINARY_TYPE 6
+// A string held by reference in the file's intern table. Cells report
+// it as STRING_TYPE; only the byte stored in the file differs, so
+// older readers see a type they don't know rather than a bad string.
+#define INTERNED_TYPE 7
+// A string deflated with the file's dictionary, for files created with
+// compressAbove. The encoding flags are those of the original string.
+#define COMPRESSED_TYPE 8
+#define TYPE_MASK 0x0f
+// Encoding flags that go with a string's type, worked out once when the
+// value is written. Interned and compressed cells keep them apart from
+// the type (see Cell::cell_encoding); frozen entries keep them in the
+// type's high bits. Plain string cells don't keep them at all.
+#define ENCODING_KNOWN 0x20
+#define ASCII_ENCODING 0x40
+// How a Cell stores those flags.
+#define STORED_UTF8 '\xc0'
+#define STORED_ASCII '\xc1'
 class WrongPropertyType: public exception {};
 class FileTooLarge: public exception {};
 
+// Scans 16 bytes at a time with SSE2 where available, else 8 at a time.
+inline bool isAscii(const char *data, size_t length) {
+  size_t i = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+  for (; i + 16 <= length; i += 16) {
+    if (_mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i))))
+      return false;
+  }
+#endif
+  for (; i + 8 <= length; i += 8) {
+    uint64_t chunk;
+    memcpy(&chunk, data + i, sizeof(chunk));
+    if (chunk & 0x8080808080808080ull)
+      return false;
+  }
+  for (; i < length; i++)
+    if (data[i] & 0x80)
+      return false;
+  return true;
+}
+
+inline char stringType(const char *value, size_t length) {
+  return STRING_TYPE | ENCODING_KNOWN | (isAscii(value, length) ? ASCII_ENCODING : 0);
+}
+
+// Tags Cell arguments that hold raw bytes rather than UTF-8 text.
+struct binary_t {};
+static const binary_t binary = {};
+
+// Tags Cell arguments that hold a compressed string, with the encoding
+// flags of the string before compression.
+struct compressed_t {
+  char flags;
+};
+
+// An entry of the intern table: how many Cells refer to the string,
+// and the type its Cells take.
+struct InternedValue {
+  uint64_t refs;
+  char type;
+  InternedValue(uint64_t refs, char type) : refs(refs), type(type) {}
+};
+typedef pair<const shared_string, InternedValue> InternedString;
+
+// The longest string a shared_string keeps in place, with no allocation
+// of its own. Interning strings this short would save nothing.
+inline size_t inlineCapacity(char_allocator allocator) {
+  return shared_string(allocator).capacity();
+}
+
 class Cell {
 private:
   char cell_type;
+  // The encoding flags of an interned string, or of the string a
+  // compressed value was made from, in what older releases left as
+  // padding. Those releases never set this byte, so it can hold anything
+  // in a cell they wrote. Only cells of a type they don't know, which
+  // they can't have written, are trusted to have it; plain strings are
+  // scanned when read instead.
+  char cell_encoding;
   union values {
     shared_string string_value;
+    bip::offset_ptr<InternedString> interned_value;
     double number_value;
-    values(const char *value, char_allocator allocator): string_value(value, allocator) {}
+    bool boolean_value;
+    values(const char *value, size_t length, char_allocator allocator): string_value(value, length, allocator) {}
     values(const double value): number_value(value) {}
+    values(const bool value): boolean_value(value) {}
     values() {}
     ~values() {}
   } cell_value;
   Cell& operator =(const Cell&) = default;
-  Cell(Cell&&) = default;
   Cell& operator=(Cell&&) & = default;
+  bool has_storage() const {
+    return (cell_type & TYPE_MASK) == STRING_TYPE || (cell_type & TYPE_MASK) == BINARY_TYPE ||
+      (cell_type & TYPE_MASK) == COMPRESSED_TYPE;
+  }
+  bool is_interned() const { return (cell_type & TYPE_MASK) == INTERNED_TYPE; }
+  // Takes a type with encoding flags and stores them apart.
+  void set_type(char type) {
+    cell_type = type & TYPE_MASK;
+    cell_encoding = !(type & ENCODING_KNOWN) ? 0 : (type & ASCII_ENCODING) ? STORED_ASCII : STORED_UTF8;
+  }
+  char encoding_flags() const {
+    if (cell_type != INTERNED_TYPE && cell_type != COMPRESSED_TYPE)
+      return 0;
+    return cell_encoding == STORED_ASCII ? ENCODING_KNOWN | ASCII_ENCODING :
+      cell_encoding == STORED_UTF8 ? ENCODING_KNOWN : 0;
+  }
+  const shared_string &string_value() const {
+    return is_interned() ? cell_value.interned_value->first : cell_value.string_value;
+  }
+  void assign_storage(char type, const char *value, size_t length, char_allocator allocator);
+  void release();
+  friend class CopiedCell;
 public:
-  Cell(const char *value, char_allocator allocator) : cell_type(STRING_TYPE), cell_value(value, allocator) {}
-  Cell(const double value) : cell_type(NUMBER_TYPE), cell_value(value) {}
+  Cell(const char *value, size_t length, char_allocator allocator) :
+    cell_type(STRING_TYPE), cell_encoding(0), cell_value(value, length, allocator) {}
+  Cell(binary_t, const char *value, size_t length, char_allocator allocator) :
+    cell_type(BINARY_TYPE), cell_encoding(0), cell_value(value, length, allocator) {}
+  Cell(compressed_t compressed, const char *value, size_t length, char_allocator allocator) :
+    cell_value(value, length, allocator) { set_type(COMPRESSED_TYPE | compressed.flags); }
+  Cell(const double value) : cell_type(NUMBER_TYPE), cell_encoding(0), cell_value(value) {}
+  Cell(const bool value) : cell_type(BOOLEAN_TYPE), cell_encoding(0), cell_value(value) {}
+  Cell(nullptr_t) : cell_type(NULL_TYPE), cell_encoding(0) {}
+  Cell(InternedString *value) : cell_type(UNINITIALIZED), cell_encoding(0) { assign(value); }
   Cell(const Cell &cell);
-  char type() { return cell_type; }
+  Cell(Cell &&cell);
+  ~Cell();
+  void assign(const char *value, size_t length, char_allocator allocator);
+  void assign(binary_t, const char *value, size_t length, char_allocator allocator);
+  void assign(compressed_t compressed, const char *value, size_t length, char_allocator allocator);
+  void assign(const double value);
+  void assign(const bool value);
+  void assign(nullptr_t);
+  void assign(InternedString *value);
+  char type() const { return is_interned() ? STRING_TYPE : cell_type & TYPE_MASK; }
+  // The intern table entry behind an interned string, else NULL.
+  const InternedString *interned() const {
+    return is_interned() ? cell_value.interned_value.get() : NULL;
+  }
+  bool encoding_known() const { return encoding_flags() & ENCODING_KNOWN; }
+  bool is_ascii() const { return encoding_flags() & ASCII_ENCODING; }
   const char *c_str();
+  const char *data();
+  size_t size();
   operator string();
   operator double();
+  explicit operator bool();
 };
 
 typedef shared_string KeyType;
@@ -80,15 +271,26 @@ typedef Cell ValueType;
 
 typedef SharedAllocator<pair<KeyType, ValueType>> map_allocator;
 
+// Compares in place: lengths first, then the raw bytes. Nothing is
+// copied out of the mapped file.
+inline bool same_bytes(const char *lhs, size_t lhs_len, const char *rhs, size_t rhs_len) {
+  return lhs_len == rhs_len && memcmp(lhs, rhs, lhs_len) == 0;
+}
+
 struct s_equal_to {
   bool operator()( const char_string& lhs, const shared_string& rhs ) const {
-    return string(lhs.c_str()) == string(rhs.c_str());
+    return same_bytes(lhs.data(), lhs.size(), rhs.data(), rhs.size());
   }
   bool operator()( const shared_string& lhs, const shared_string& rhs ) const {
-    return string(lhs.c_str()) == string(rhs.c_str());
+    return same_bytes(lhs.data(), lhs.size(), rhs.data(), rhs.size());
+  }
+  bool operator()( const boost::string_ref& lhs, const shared_string& rhs ) const {
+    return same_bytes(lhs.data(), lhs.size(), rhs.data(), rhs.size());
   }
 };
 
+// Every overload must hash exactly like boost::hash<shared_string> so
+// that lookups land in the buckets of files already on disk.
 class hasher {
 public:
   size_t operator() (shared_string const& key) const {
@@ -97,6 +299,15 @@ public:
   size_t operator() (char_string const& key) const {
     return boost::hash<char_string>()(key);
   }
+  size_t operator() (boost::string_ref const& key) const {
+    return boost::hash_range(key.begin(), key.end());
+  }
+};
+
+// Stands in for the hasher once a key's hash is already known.
+struct precomputed_hash {
+  size_t hash;
+  size_t operator() (boost::string_ref const&) const { return hash; }
 };
 
 typedef boost::unordered_map<
@@ -106,11 +317,812 @@ typedef boost::unordered_map<
   s_equal_to,
   map_allocator> PropertyHash;
 
+// String values shared by many keys, for files created with
+// {internStrings: true}.
+typedef boost::unordered_map<
+  shared_string,
+  InternedValue,
+  hasher,
+  s_equal_to,
+  SharedAllocator<InternedString>> InternTable;
+
+// Kept in files created with compressAbove, so that readers can
+// decompress and later writers go on compressing the same way.
+struct CompressionSettings {
+  uint64_t threshold; // Strings longer than this are compressed.
+  shared_string dictionary;
+  CompressionSettings(uint64_t threshold, const char *dictionary, size_t length,
+                      char_allocator allocator) :
+    threshold(threshold), dictionary(dictionary, length, allocator) {}
+};
+
+// Kept in files created with {concurrent: true}. Readers share it and
+// writers hold it alone, whichever process they are in.
+typedef bip::interprocess_upgradable_mutex FileMutex;
+
+// Kept in files created with {live: true}. The one writer makes the
+// sequence odd while it changes anything and even again when it's
+// done, so a reader that sees the same even sequence before and after
+// a lookup knows the lookup saw no change half made.
+struct LiveState {
+  atomic<uint64_t> sequence;
+  uint64_t segment_offset; // Where the segment starts in the file.
+  int32_t writer; // The writing process, or 0.
+  LiveState(uint64_t segment_offset) :
+    sequence(0), segment_offset(segment_offset), writer(0) {}
+};
+
+// The part of a live file a reader has mapped. A reader checks that
+// anything the writer may be changing lies inside before following a
+// pointer to it, so a torn read can't fault. The sequence check then
+// throws away whatever it read.
+struct Span {
+  uintptr_t begin;
+  uintptr_t end;
+  Span(const void *begin, size_t length) :
+    begin((uintptr_t)begin), end((uintptr_t)begin + length) {}
+  bool holds(const void *data, size_t length) const {
+    uintptr_t at = (uintptr_t)data;
+    return at >= begin && at <= end && length <= end - at;
+  }
+};
+
+// A Cell's value copied out of a live file, for cellValue() to read
+// once the copy is known to be whole.
+class CopiedCell {
+  char cell_type;
+  string bytes;
+  union {
+    double number_value;
+    bool boolean_value;
+  };
+public:
+  CopiedCell() : cell_type(UNINITIALIZED) {}
+  bool copy(const Cell &cell, const Span &span);
+  char type() const { return cell_type & TYPE_MASK; }
+  bool encoding_known() const { return cell_type & ENCODING_KNOWN; }
+  bool is_ascii() const { return cell_type & ASCII_ENCODING; }
+  const char *data() const { return bytes.data(); }
+  size_t size() const { return bytes.size(); }
+  operator double() const { return number_value; }
+  explicit operator bool() const { return boolean_value; }
+};
+
+// Returns false if the cell doesn't hold a value that lies in span.
+bool CopiedCell::copy(const Cell &cell, const Span &span) {
+  char raw_type = cell.cell_type | cell.encoding_flags();
+  const shared_string *value = &cell.cell_value.string_value;
+  switch (raw_type & TYPE_MASK) {
+  case INTERNED_TYPE: {
+    const InternedString *interned = cell.cell_value.interned_value.get();
+    if (!span.holds(interned, sizeof(*interned)))
+      return false;
+    value = &interned->first;
+    raw_type = STRING_TYPE | (raw_type & ~TYPE_MASK);
+  } // Fall through
+  case STRING_TYPE:
+  case BINARY_TYPE:
+  case COMPRESSED_TYPE: {
+    const char *data = value->data();
+    size_t length = value->size();
+    if (!span.holds(data, length))
+      return false;
+    bytes.assign(data, length);
+    break;
+  }
+  case NUMBER_TYPE:
+    number_value = cell.cell_value.number_value;
+    break;
+  case BOOLEAN_TYPE:
+    boolean_value = cell.cell_value.boolean_value;
+    break;
+  case NULL_TYPE:
+    break;
+  default:
+    return false;
+  }
+  cell_type = raw_type;
+  return true;
+}
+
+// Raw deflate with a preset dictionary, reusing one zlib stream in each
+// direction. Compressed values start with their length before
+// compression, so inflating needs no guesswork about the output size.
+class Compressor {
+  z_stream deflater;
+  z_stream inflater;
+  bool deflating;
+  bool inflating;
+public:
+  Compressor() : deflating(false), inflating(false) {
+    memset(&deflater, 0, sizeof(deflater));
+    memset(&inflater, 0, sizeof(inflater));
+  }
+  ~Compressor() {
+    if (deflating)
+      deflateEnd(&deflater);
+    if (inflating)
+      inflateEnd(&inflater);
+  }
+  bool deflate(const char *value, size_t length, const char *dictionary, size_t dictionary_length,
+               string &out);
+  bool inflate(const char *data, size_t length, const char *dictionary, size_t dictionary_length,
+               string &out);
+};
+
+// Compresses value into out. Returns false when that saves nothing.
+bool Compressor::deflate(const char *value, size_t length, const char *dictionary,
+                         size_t dictionary_length, string &out) {
+  if (length > UINT32_MAX)
+    return false;
+  if (!deflating) {
+    if (deflateInit2(&deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+      return false;
+    deflating = true;
+  } else {
+    deflateReset(&deflater);
+  }
+  if (dictionary_length)
+    deflateSetDictionary(&deflater, reinterpret_cast<const Bytef *>(dictionary), dictionary_length);
+  uint32_t original = length;
+  out.resize(sizeof(original) + deflateBound(&deflater, length));
+  memcpy(&out[0], &original, sizeof(original));
+  deflater.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(value));
+  deflater.avail_in = length;
+  deflater.next_out = reinterpret_cast<Bytef *>(&out[sizeof(original)]);
+  deflater.avail_out = out.size() - sizeof(original);
+  if (::deflate(&deflater, Z_FINISH) != Z_STREAM_END)
+    return false;
+  out.resize(sizeof(original) + deflater.total_out);
+  return out.size() < length;
+}
+
+// Decompresses data from deflate() into out. Returns false when the
+// data is corrupt.
+bool Compressor::inflate(const char *data, size_t length, const char *dictionary,
+                         size_t dictionary_length, string &out) {
+  uint32_t original;
+  if (length < sizeof(original))
+    return false;
+  memcpy(&original, data, sizeof(original));
+  if (!inflating) {
+    if (inflateInit2(&inflater, -MAX_WBITS) != Z_OK)
+      return false;
+    inflating = true;
+  } else {
+    inflateReset(&inflater);
+  }
+  if (dictionary_length &&
+      inflateSetDictionary(&inflater, reinterpret_cast<const Bytef *>(dictionary),
+                           dictionary_length) != Z_OK)
+    return false;
+  out.resize(original);
+  inflater.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data + sizeof(original)));
+  inflater.avail_in = length - sizeof(original);
+  inflater.next_out = reinterpret_cast<Bytef *>(&out[0]);
+  inflater.avail_out = original;
+  return ::inflate(&inflater, Z_FINISH) == Z_STREAM_END && inflater.total_out == original;
+}
+
+// Segment bytes an entry costs beyond its key and value bytes: the node
+// with its links, plus allocator headers. Deliberately generous.
+static const size_t entry_overhead = sizeof(PropertyHash::value_type) + 64;
+
+// Upper bound on the bucket array for keys entries.
+inline size_t bucketBytes(size_t keys, float max_load_factor) {
+  return 2 * sizeof(void *) * (size_t)(keys / max_load_factor + 1);
+}
+
+// Spreads a key's hash over all 64 bits for the tables that index by
+// parts of it. The chained table hashes keys as they are.
+inline uint64_t mixHash(uint64_t hash) {
+  uint64_t mixed = hash * 0x9e3779b97f4a7c15ull;
+  return mixed ^ (mixed >> 32);
+}
+
+// Open-addressing alternative to PropertyHash, chosen at Create time.
+// Entries sit directly in one slot array, with keys of up to 22 bytes
+// stored inline by shared_string, so a cold lookup touches a group of
+// control bytes and then the slot itself rather than a bucket, a node
+// and a string. Each control byte holds 7 bits of the key's hash, or
+// marks the slot empty or deleted; slots are probed 16 at a time.
+// Everything in it is an offset or an offset_ptr, so it works at any
+// address.
+class FlatHash {
+public:
+  typedef pair<KeyType, ValueType> value_type;
+  static const size_t GROUP = 16;
+  FlatHash(size_t buckets, char_allocator allocator);
+  ~FlatHash();
+  value_type *find(boost::string_ref key, size_t hash);
+  const value_type *find(boost::string_ref key, size_t hash, const Span &span, bool &torn) const;
+  bool keys(const Span &span, vector<string> &out) const;
+  template <typename... Value>
+  void emplace(boost::string_ref key, size_t hash, Value... value);
+  void erase(value_type *entry);
+  template <typename Op> void each(Op op);
+  void prefetch(size_t hash) const;
+  void reserve(size_t keys) { rehash((size_t)ceil(keys / mlf)); }
+  void rehash(size_t buckets);
+  size_t size() const { return count; }
+  size_t bucket_count() const { return capacity; }
+  size_t max_bucket_count() const { return allocator.max_size() / slot_bytes; }
+  float load_factor() const { return capacity ? (float)count / capacity : 0; }
+  float max_load_factor() const { return mlf; }
+  void max_load_factor(float factor) { mlf = factor < max_flat_load ? factor : max_flat_load; }
+  static size_t bytesFor(size_t keys, float max_load_factor) {
+    return 2 * slot_bytes * ((size_t)(keys / max_load_factor) + GROUP);
+  }
+private:
+  static const uint8_t EMPTY = 0x80;
+  static const uint8_t DELETED = 0xfe;
+  static const size_t slot_bytes = sizeof(value_type) + 1;
+  // A group must always keep a free slot for probes to end on.
+  static constexpr float max_flat_load = 0.9375;
+  char_allocator allocator;
+  bip::offset_ptr<char> storage; // capacity slots, then capacity control bytes
+  uint64_t capacity;
+  uint64_t count;
+  uint64_t tombstones;
+  float mlf;
+  value_type *slots() const { return reinterpret_cast<value_type *>(storage.get()); }
+  uint8_t *ctrl() const { return reinterpret_cast<uint8_t *>(storage.get()) + capacity * sizeof(value_type); }
+  static size_t freeSlot(const uint8_t *ctrl, size_t capacity, uint64_t mixed);
+};
+
+// Bit i is set where byte i of the 16-byte group equals value.
+inline uint32_t matchByte(const uint8_t *group, uint8_t value) {
+#if defined(__SSE2__) || defined(_M_X64)
+  __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(group));
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8((char)value)));
+#else
+  uint32_t bits = 0;
+  for (size_t i = 0; i < FlatHash::GROUP; i++)
+    bits |= (uint32_t)(group[i] == value) << i;
+  return bits;
+#endif
+}
+
+// Bit i is set where slot i of the group is empty or deleted.
+inline uint32_t matchFree(const uint8_t *group) {
+#if defined(__SSE2__) || defined(_M_X64)
+  return _mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(group)));
+#else
+  uint32_t bits = 0;
+  for (size_t i = 0; i < FlatHash::GROUP; i++)
+    bits |= (uint32_t)(group[i] >> 7) << i;
+  return bits;
+#endif
+}
+
+inline unsigned lowestBit(uint32_t bits) {
+#if defined(_MSC_VER)
+  unsigned long index;
+  _BitScanForward(&index, bits);
+  return index;
+#else
+  return __builtin_ctz(bits);
+#endif
+}
+
+template <typename Op>
+void FlatHash::each(Op op) {
+  uint8_t *control = ctrl();
+  for (size_t i = 0; i < capacity; i++)
+    if (!(control[i] & 0x80))
+      op(slots()[i]);
+}
+
+FlatHash::FlatHash(size_t buckets, char_allocator allocator) :
+  allocator(allocator), storage(0), capacity(0), count(0), tombstones(0), mlf(0.875) {
+  if (buckets)
+    rehash(buckets);
+}
+
+FlatHash::~FlatHash() {
+  each([](value_type &entry) { entry.~value_type(); });
+  if (storage)
+    allocator.deallocate(storage, capacity * slot_bytes);
+}
+
+// Groups are probed triangularly, which visits every group of a
+// power-of-two table. A group with an empty slot ends the search.
+FlatHash::value_type *FlatHash::find(boost::string_ref key, size_t hash) {
+  if (count == 0)
+    return NULL;
+  uint64_t mixed = mixHash(hash);
+  uint8_t tag = mixed & 0x7f;
+  size_t mask = capacity / GROUP - 1;
+  size_t group = (mixed >> 7) & mask;
+  for (size_t step = 1; ; group = (group + step++) & mask) {
+    const uint8_t *control = ctrl() + group * GROUP;
+    for (uint32_t matches = matchByte(control, tag); matches; matches &= matches - 1) {
+      value_type *entry = slots() + group * GROUP + lowestBit(matches);
+      if (same_bytes(key.data(), key.size(), entry->first.data(), entry->first.size()))
+        return entry;
+    }
+    if (matchByte(control, EMPTY))
+      return NULL;
+  }
+}
+
+// find() for live readers, which may run while the writer changes the
+// table. Reads the table's layout once and checks everything against
+// span before reading it. Sets torn when something didn't add up.
+const FlatHash::value_type *FlatHash::find(boost::string_ref key, size_t hash,
+                                           const Span &span, bool &torn) const {
+  const char *base = storage.get();
+  uint64_t slot_count = capacity;
+  if (count == 0)
+    return NULL;
+  if (slot_count < GROUP || (slot_count & (slot_count - 1)) ||
+      slot_count > (span.end - span.begin) / slot_bytes ||
+      !span.holds(base, slot_count * slot_bytes)) {
+    torn = true;
+    return NULL;
+  }
+  const value_type *entries = reinterpret_cast<const value_type *>(base);
+  const uint8_t *control = reinterpret_cast<const uint8_t *>(base) + slot_count * sizeof(value_type);
+  uint64_t mixed = mixHash(hash);
+  uint8_t tag = mixed & 0x7f;
+  size_t mask = slot_count / GROUP - 1;
+  size_t group = (mixed >> 7) & mask;
+  for (size_t step = 1; step <= slot_count / GROUP; group = (group + step++) & mask) {
+    for (uint32_t matches = matchByte(control + group * GROUP, tag); matches; matches &= matches - 1) {
+      const value_type *entry = entries + group * GROUP + lowestBit(matches);
+      const char *data = entry->first.data();
+      size_t length = entry->first.size();
+      if (!span.holds(data, length)) {
+        torn = true;
+        return NULL;
+      }
+      if (same_bytes(key.data(), key.size(), data, length))
+        return entry;
+    }
+    if (matchByte(control + group * GROUP, EMPTY))
+      return NULL;
+  }
+  torn = true; // Every group full: not a table the writer would leave.
+  return NULL;
+}
+
+// Copies every key into out for live readers, checking as find() does.
+// Returns false when something didn't add up.
+bool FlatHash::keys(const Span &span, vector<string> &out) const {
+  const char *base = storage.get();
+  uint64_t slot_count = capacity;
+  out.clear();
+  if (slot_count > (span.end - span.begin) / slot_bytes ||
+      !span.holds(base, slot_count * slot_bytes))
+    return false;
+  const value_type *entries = reinterpret_cast<const value_type *>(base);
+  const uint8_t *control = reinterpret_cast<const uint8_t *>(base) + slot_count * sizeof(value_type);
+  for (size_t i = 0; i < slot_count; i++) {
+    if (control[i] & 0x80)
+      continue;
+    const char *data = entries[i].first.data();
+    size_t length = entries[i].first.size();
+    if (!span.holds(data, length))
+      return false;
+    out.push_back(string(data, length));
+  }
+  return true;
+}
+
+size_t FlatHash::freeSlot(const uint8_t *ctrl, size_t capacity, uint64_t mixed) {
+  size_t mask = capacity / GROUP - 1;
+  size_t group = (mixed >> 7) & mask;
+  for (size_t step = 1; ; group = (group + step++) & mask) {
+    uint32_t free = matchFree(ctrl + group * GROUP);
+    if (free)
+      return group * GROUP + lowestBit(free);
+  }
+}
+
+// Adds an entry for a key that isn't in the table yet, building the
+// key and Cell in their slot. The table is only touched once the
+// entry has been built, so a bad_alloc leaves it as it was.
+template <typename... Value>
+void FlatHash::emplace(boost::string_ref key, size_t hash, Value... value) {
+  if (count + tombstones + 1 > capacity * mlf)
+    rehash(count + 1 > capacity * mlf / 2 ? capacity * 2 : capacity);
+  uint64_t mixed = mixHash(hash);
+  size_t slot = freeSlot(ctrl(), capacity, mixed);
+  new (slots() + slot) value_type(piecewise_construct,
+                                  forward_as_tuple(key.data(), key.size(), allocator),
+                                  forward_as_tuple(value...));
+  if (ctrl()[slot] == DELETED)
+    tombstones--;
+  ctrl()[slot] = mixed & 0x7f;
+  count++;
+}
+
+// A slot can go straight back to empty when its group still has an
+// empty slot: no probe has ever passed through such a group.
+void FlatHash::erase(value_type *entry) {
+  size_t slot = entry - slots();
+  entry->~value_type();
+  count--;
+  if (matchByte(ctrl() + slot / GROUP * GROUP, EMPTY)) {
+    ctrl()[slot] = EMPTY;
+  } else {
+    ctrl()[slot] = DELETED;
+    tombstones++;
+  }
+}
+
+// Moves every entry into a new array of at least buckets slots, enough
+// for the current entries at the maximum load factor. Deleted slots
+// are dropped along the way.
+void FlatHash::rehash(size_t buckets) {
+  size_t wanted = max(buckets, (size_t)(count / mlf) + 1);
+  size_t new_capacity = GROUP;
+  while (new_capacity < wanted)
+    new_capacity *= 2;
+  if (new_capacity == capacity && tombstones == 0)
+    return;
+
+  bip::offset_ptr<char> new_storage = allocator.allocate(new_capacity * slot_bytes);
+  value_type *new_slots = reinterpret_cast<value_type *>(new_storage.get());
+  uint8_t *new_ctrl = reinterpret_cast<uint8_t *>(new_storage.get()) + new_capacity * sizeof(value_type);
+  memset(new_ctrl, EMPTY, new_capacity);
+  each([&](value_type &entry) {
+    uint64_t mixed = mixHash(hasher()(boost::string_ref(entry.first.data(), entry.first.size())));
+    size_t slot = freeSlot(new_ctrl, new_capacity, mixed);
+    new (new_slots + slot) value_type(boost::move(entry));
+    new_ctrl[slot] = mixed & 0x7f;
+    entry.~value_type();
+  });
+  if (storage)
+    allocator.deallocate(storage, capacity * slot_bytes);
+  storage = new_storage;
+  capacity = new_capacity;
+  tombstones = 0;
+}
+
+void FlatHash::prefetch(size_t hash) const {
+  if (count == 0)
+    return;
+  size_t group = (mixHash(hash) >> 7) & (capacity / GROUP - 1);
+#if defined(__GNUC__)
+  __builtin_prefetch(ctrl() + group * GROUP);
+  __builtin_prefetch(slots() + group * GROUP);
+#elif defined(_M_X64)
+  _mm_prefetch(reinterpret_cast<const char *>(ctrl() + group * GROUP), _MM_HINT_T0);
+  _mm_prefetch(reinterpret_cast<const char *>(slots() + group * GROUP), _MM_HINT_T0);
+#endif
+}
+
+// A frozen file is the compact, immutable layout written by
+// close({compact: true}) and freeze(). After the header comes a
+// directory, then the entries sorted by mixed hash, then a heap of key
+// and value bytes. Directory slot i holds the index of the first entry
+// whose hash has i in its top directory_bits bits, so a lookup scans a
+// few neighbouring entries. All offsets count from the start of the
+// file.
+//
+// With {perfectHash: true} the directory gives way to a minimal perfect
+// hash in the style of PTHash: keys fall into buckets, and each bucket
+// stores a 16-bit pilot chosen so that its keys land on distinct slots.
+// Entries are stored in slot order, so a lookup reads one pilot and one
+// entry, and the entry's hash serves as the fingerprint before the key
+// compare. There are slightly more slots than keys to make pilots easy
+// to find; the remap table points the few keys past the end back into
+// the holes they leave.
+//
+// From version 3, keys and string or binary values of up to
+// FROZEN_INLINE_SIZE bytes are kept in the entry itself rather than the
+// heap, so looking one up doesn't touch another cache line.
+//
+// Version 4 adds the dictionary of files created with compressAbove.
+// Compressed values are frozen as they are, and the dictionary follows
+// the heap.
+#define FROZEN_MAGIC "MMOBJFRZ"
+#define FROZEN_VERSION 4
+#define FROZEN_INLINE_SIZE 8
+
+struct FrozenHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t directory_bits;
+  uint64_t count;
+  uint64_t directory;
+  uint64_t entries;
+  uint64_t heap;
+  uint64_t file_size;
+  // Version 2 on; pilots is 0 when the directory is used instead.
+  uint64_t pilots;
+  uint64_t buckets;
+  uint64_t dense_buckets;
+  uint64_t slots;
+  uint64_t remap;
+  uint64_t seed;
+  // Version 4 on.
+  uint64_t dictionary;
+  uint64_t dictionary_length;
+};
+
+// Each version's header ends where the next version's fields begin.
+inline size_t frozenHeaderSize(uint32_t version) {
+  return version < 2 ? offsetof(FrozenHeader, pilots) :
+    version < 4 ? offsetof(FrozenHeader, dictionary) : sizeof(FrozenHeader);
+}
+
+// Sends about 60% of keys to the first 30% of buckets. Uneven buckets
+// are what lets most pilots stay small.
+inline uint64_t perfectBucket(uint64_t u, uint64_t buckets, uint64_t dense) {
+  uint64_t low = u & 0xffffffff;
+  if ((u >> 32) < 0x99999999ull && dense)
+    return (low * dense) >> 32;
+  return dense + ((low * (buckets - dense)) >> 32);
+}
+
+inline uint64_t perfectSlot(uint64_t u, uint16_t pilot, uint64_t seed, uint64_t slots) {
+  return mixHash(u ^ mixHash(pilot + seed)) % slots;
+}
+
+struct FrozenEntry {
+  uint64_t hash;
+  union {
+    uint64_t offset;
+    char bytes[FROZEN_INLINE_SIZE];
+  } key;
+  uint32_t key_length;
+  uint32_t value_length;
+  uint8_t type; // A Cell type, with its encoding flags.
+  uint8_t padding[7];
+  union {
+    double number;
+    uint64_t offset;
+    uint8_t boolean;
+    char bytes[FROZEN_INLINE_SIZE];
+  } value;
+};
+
+// A frozen entry's value, read through the same calls as a Cell's so
+// both convert to Javascript the same way.
+class FrozenCell {
+  const char *base;
+  const FrozenEntry *entry;
+  bool inlined;
+public:
+  FrozenCell(const char *base, const FrozenEntry *entry, bool inlined) :
+    base(base), entry(entry), inlined(inlined) {}
+  char type() const { return entry->type & TYPE_MASK; }
+  bool encoding_known() const { return entry->type & ENCODING_KNOWN; }
+  bool is_ascii() const { return entry->type & ASCII_ENCODING; }
+  const char *data() const {
+    return inlined && entry->value_length <= FROZEN_INLINE_SIZE ?
+      entry->value.bytes : base + entry->value.offset;
+  }
+  size_t size() const { return entry->value_length; }
+  explicit operator double() const { return entry->value.number; }
+  explicit operator bool() const { return entry->value.boolean; }
+};
+
+// Reads a frozen file in place.
+class FrozenTable {
+  const char *base;
+  size_t length;
+  const FrozenHeader *header;
+  const uint64_t *directory;
+  const FrozenEntry *entries;
+  const uint16_t *pilots; // Set instead of directory for a perfect hash.
+  const uint64_t *remap;
+  bool inlined; // Short keys and values are in the entries.
+  uint64_t slotOf(size_t hash) const;
+  bool intact(const FrozenEntry *entry) const;
+  const char *keyOf(const FrozenEntry *entry) const {
+    return inlined && entry->key_length <= FROZEN_INLINE_SIZE ?
+      entry->key.bytes : base + entry->key.offset;
+  }
+public:
+  FrozenTable(const char *base, size_t length) : base(base), length(length),
+    header(reinterpret_cast<const FrozenHeader *>(base)),
+    directory(reinterpret_cast<const uint64_t *>(base + header->directory)),
+    entries(reinterpret_cast<const FrozenEntry *>(base + header->entries)),
+    pilots(isPerfect(base) ? reinterpret_cast<const uint16_t *>(base + header->pilots) : NULL),
+    remap(pilots ? reinterpret_cast<const uint64_t *>(base + header->remap) : NULL),
+    inlined(header->version >= 3) {}
+  static bool isFrozen(const char *base, size_t length) {
+    return length >= frozenHeaderSize(1) && memcmp(base, FROZEN_MAGIC, 8) == 0;
+  }
+  static bool isPerfect(const char *base) {
+    auto header = reinterpret_cast<const FrozenHeader *>(base);
+    return header->version >= 2 && header->pilots;
+  }
+  static bool isIntact(const char *base, size_t length);
+  bool find(boost::string_ref key, size_t hash, const FrozenEntry *&entry) const;
+  FrozenCell value(const FrozenEntry *entry) const { return FrozenCell(base, entry, inlined); }
+  boost::string_ref dictionary() const {
+    if (header->version < 4)
+      return boost::string_ref();
+    return boost::string_ref(base + header->dictionary, header->dictionary_length);
+  }
+  // Returns false if the file is corrupt.
+  template <typename Op> bool each(Op op) const {
+    for (uint64_t i = 0; i < header->count; i++) {
+      if (!intact(entries + i))
+        return false;
+      op(keyOf(entries + i), entries[i].key_length);
+    }
+    return true;
+  }
+  void prefetch(size_t hash) const;
+  size_t size() const { return header->count; }
+  size_t bucket_count() const { return pilots ? header->slots : (size_t)1 << header->directory_bits; }
+  size_t max_bucket_count() const { return bucket_count(); }
+  float load_factor() const { return bucket_count() ? (float)size() / bucket_count() : 0; }
+  float max_load_factor() const { return load_factor(); }
+};
+
+// True if the file at path exists and is frozen.
+bool isFrozenFile(const char *path) {
+  char magic[8];
+  FILE *file = fopen(path, "rb");
+  if (file == NULL)
+    return false;
+  bool frozen = fread(magic, sizeof(magic), 1, file) == 1 && memcmp(magic, FROZEN_MAGIC, 8) == 0;
+  fclose(file);
+  return frozen;
+}
+
+// True if count items of size bytes starting at offset fit in length.
+inline bool fitsIn(uint64_t offset, uint64_t count, size_t size, size_t length) {
+  return offset <= length && count <= (length - offset) / size;
+}
+
+// Checks that the header's sections lie within the file. What's in
+// them is checked as lookups read it, so opening a file doesn't have to
+// page in all of it.
+bool FrozenTable::isIntact(const char *base, size_t length) {
+  auto header = reinterpret_cast<const FrozenHeader *>(base);
+  if (header->version < 1 || header->version > FROZEN_VERSION ||
+      length < frozenHeaderSize(header->version) || header->file_size != length ||
+      !fitsIn(header->entries, header->count, sizeof(FrozenEntry), length) || header->heap > length)
+    return false;
+  if (header->version >= 4 && !fitsIn(header->dictionary, header->dictionary_length, 1, length))
+    return false;
+  if (!isPerfect(base))
+    return header->directory_bits < 64 &&
+      fitsIn(header->directory, ((uint64_t)1 << header->directory_bits) + 1, sizeof(uint64_t), length);
+  return header->buckets != 0 && header->dense_buckets < header->buckets &&
+    header->slots >= header->count && header->slots != 0 &&
+    fitsIn(header->pilots, header->buckets, sizeof(uint16_t), length) &&
+    fitsIn(header->remap, header->slots - header->count, sizeof(uint64_t), length);
+}
+
+// Whether an entry's key and value lie within the file.
+bool FrozenTable::intact(const FrozenEntry *entry) const {
+  if (!(inlined && entry->key_length <= FROZEN_INLINE_SIZE) &&
+      !fitsIn(entry->key.offset, entry->key_length, 1, length))
+    return false;
+  char type = entry->type & TYPE_MASK;
+  return (type != STRING_TYPE && type != BINARY_TYPE && type != COMPRESSED_TYPE) ||
+    (inlined && entry->value_length <= FROZEN_INLINE_SIZE) ||
+    fitsIn(entry->value.offset, entry->value_length, 1, length);
+}
+
+// The entry a key would be in, for a perfect hash.
+uint64_t FrozenTable::slotOf(size_t hash) const {
+  uint64_t u = mixHash(mixHash(hash) ^ header->seed);
+  uint64_t bucket = perfectBucket(u, header->buckets, header->dense_buckets);
+  uint64_t slot = perfectSlot(u, pilots[bucket], header->seed, header->slots);
+  return slot < header->count ? slot : remap[slot - header->count];
+}
+
+// Sets entry to key's entry, or NULL if there is none. Returns false if
+// the file is corrupt: each directory slot, remapped slot and entry is
+// checked as it is read.
+bool FrozenTable::find(boost::string_ref key, size_t hash, const FrozenEntry *&entry) const {
+  entry = NULL;
+  uint64_t mixed = mixHash(hash);
+  if (pilots) {
+    uint64_t slot = slotOf(hash);
+    if (slot >= header->count)
+      return false;
+    const FrozenEntry *candidate = entries + slot;
+    if (candidate->hash != mixed)
+      return true;
+    if (!intact(candidate))
+      return false;
+    if (same_bytes(key.data(), key.size(), keyOf(candidate), candidate->key_length))
+      entry = candidate;
+    return true;
+  }
+  uint64_t slot = header->directory_bits ? mixed >> (64 - header->directory_bits) : 0;
+  uint64_t end = directory[slot + 1];
+  if (end > header->count)
+    return false;
+  for (uint64_t i = directory[slot]; i < end; i++) {
+    const FrozenEntry *candidate = entries + i;
+    if (candidate->hash > mixed)
+      break;
+    if (candidate->hash != mixed)
+      continue;
+    if (!intact(candidate))
+      return false;
+    if (same_bytes(key.data(), key.size(), keyOf(candidate), candidate->key_length)) {
+      entry = candidate;
+      break;
+    }
+  }
+  return true;
+}
+
+void FrozenTable::prefetch(size_t hash) const {
+  const FrozenEntry *entry;
+  if (pilots) {
+    entry = entries + slotOf(hash);
+  } else {
+    uint64_t mixed = mixHash(hash);
+    uint64_t slot = header->directory_bits ? mixed >> (64 - header->directory_bits) : 0;
+    entry = entries + directory[slot];
+  }
+#if defined(__GNUC__)
+  __builtin_prefetch(entry);
+#elif defined(_M_X64)
+  _mm_prefetch(reinterpret_cast<const char *>(entry), _MM_HINT_T0);
+#endif
+}
+
+// Owns the mapping behind an Open object. Buffers handed to V8 that
+// point straight into the file hold a reference, so close() only
+// unmaps once the last of them has been garbage collected.
+class SharedMapping {
+  bip::managed_mapped_file *map_seg;
+  bip::mapped_region *region; // For frozen files instead.
+  atomic<unsigned> refs;
+public:
+  SharedMapping(bip::managed_mapped_file *map_seg) : map_seg(map_seg), region(NULL), refs(1) {}
+  SharedMapping(bip::mapped_region *region) : map_seg(NULL), region(region), refs(1) {}
+  void retain() { refs++; }
+  void release() {
+    if (--refs == 0) {
+      delete map_seg;
+      delete region;
+      delete this;
+    }
+  }
+  static void release_buffer(char *, void *mapping) {
+    static_cast<SharedMapping *>(mapping)->release();
+  }
+};
+
+// A string value of a read-only file handed to V8 without copying.
+// V8 disposes of the resource when the string is collected, which
+// drops its hold on the mapping.
+class MappedString : public v8::String::ExternalOneByteStringResource {
+  SharedMapping *mapping;
+  const char *bytes;
+  size_t byte_length;
+public:
+  MappedString(SharedMapping *mapping, const char *bytes, size_t byte_length) :
+    mapping(mapping), bytes(bytes), byte_length(byte_length) {
+    mapping->retain();
+  }
+  ~MappedString() { mapping->release(); }
+  const char *data() const { return bytes; }
+  size_t length() const { return byte_length; }
+};
+
 class SharedMap : public Nan::ObjectWrap {
-  SharedMap(string file_name, size_t file_size, size_t max_file_size) :
+  SharedMap(string file_name, size_t file_size, size_t max_file_size,
+            double growth_factor, size_t min_growth) :
     file_name(file_name), file_size(file_size), max_file_size(max_file_size),
-    readonly(false), closed(true) {}
-  SharedMap(string file_name) : file_name(file_name), readonly(false), closed(true) {}
+    growth_factor(growth_factor), min_growth(min_growth), grows(0), flushed(0),
+    reservation(NULL), reserved(0), fd(-1), property_map(NULL), flat_map(NULL),
+    intern_table(NULL), compression(NULL), compressor(NULL), lock(NULL), mapped_size(0),
+    live(NULL), frozen(NULL), mapping(NULL), external_strings(false), external_buffers(false),
+    readonly(false), closed(true), closing(false) {}
+  SharedMap(string file_name) : file_name(file_name), grows(0), flushed(0),
+                                reservation(NULL), reserved(0), fd(-1),
+                                property_map(NULL), flat_map(NULL), intern_table(NULL),
+                                compression(NULL), compressor(NULL), lock(NULL), mapped_size(0),
+                                live(NULL), frozen(NULL), mapping(NULL), external_strings(false),
+                                external_buffers(false), readonly(false), closed(true),
+                                closing(false) {}
 
 public:
   static NAN_MODULE_INIT(Init);
@@ -119,24 +1131,68 @@ private:
   string file_name;
   size_t file_size;
   size_t max_file_size;
+  double growth_factor;
+  size_t min_growth;
+  size_t grows;
+  size_t flushed;
+  char *reservation; // Address space the file grows into, if reserved.
+  size_t reserved;
+  int fd;
   bip::managed_mapped_file *map_seg;
   PropertyHash *property_map;
+  FlatHash *flat_map; // Set instead of property_map for flat tables.
+  InternTable *intern_table; // Only for files that intern their strings.
+  CompressionSettings *compression; // Only for files that compress.
+  Compressor *compressor; // Made on first use.
+  string deflated; // Scratch space for the compressor.
+  string inflated;
+  FileMutex *lock; // Only for concurrent files.
+  size_t mapped_size; // How much of a concurrent or live file this process has mapped.
+  LiveState *live; // Only for live files.
+  FrozenTable *frozen; // Set instead of either for frozen files.
+  SharedMapping *mapping;
+  bool external_strings;
+  bool external_buffers;
   bool readonly;
   bool closed;
+  bool closing; // While a background close() runs.
   void grow(size_t);
+  void reserve_address_space();
+  void release_address_space();
+  void sync();
+  void make_room(size_t bytes);
+  void resize_table(size_t buckets);
+  void find_table();
+  void lock_file(bool exclusive);
+  void unlock_file(bool exclusive);
+  void remap();
+  template <typename Read> bool read_live(Read read);
+  bool find_live(boost::string_ref key, size_t hash, CopiedCell &cell, bool &found);
+  Cell *find(boost::string_ref key, size_t hash);
+  void erase(boost::string_ref key);
+  InternedString *intern(const char *value, size_t length);
+  void sweep_interned();
+  boost::string_ref dictionary();
+  bool inflate(const char *data, size_t length);
+  size_t table_bytes(size_t keys);
+  void write_frozen(const string &path, bool perfect);
+  static void close(const Nan::FunctionCallbackInfo<v8::Value> &info, bool compact, bool perfect,
+                    v8::Local<v8::Value> callback);
+  template <typename Op> void with_room(size_t wanted, Op op);
+  template <typename... Value> void store(boost::string_ref key, Value... value);
+  void set(boost::string_ref key, v8::Local<v8::Value> value);
+  bool put(boost::string_ref key, v8::Local<v8::Value> value);
+  void remove_key(boost::string_ref key);
+  template <typename Result> void get(boost::string_ref key, size_t hash, Result result);
+  bool append_keys(v8::Local<v8::Array> arr);
+  template <typename Value, typename Result> void cellValue(Value *c, Result result);
   static NAN_METHOD(Create);
   static NAN_METHOD(Open);
-  static NAN_METHOD(Close);
-  static NAN_METHOD(isClosed);
-  static NAN_METHOD(isOpen);
-  static NAN_METHOD(isData);
-  static NAN_METHOD(get_free_memory);
-  static NAN_METHOD(get_size);
-  static NAN_METHOD(bucket_count);
-  static NAN_METHOD(max_bucket_count);
-  static NAN_METHOD(load_factor);
-  static NAN_METHOD(max_load_factor);
+#define DECLARE_METHOD(name, method) static NAN_METHOD(method);
+  SHARED_MAP_METHODS(DECLARE_METHOD)
+#undef DECLARE_METHOD
   static NAN_METHOD(inspect);
+  static v8::Local<v8::Function> inspector();
   static NAN_PROPERTY_SETTER(PropSetter);
   static NAN_PROPERTY_GETTER(PropGetter);
   static NAN_PROPERTY_QUERY(PropQuery);
@@ -154,39 +1210,70 @@ private:
     return my_constructor;
   }
   friend struct CloseWorker;
+  friend struct FlushWorker;
+  friend class FileLock;
+  friend class ShardedMap;
 };
 
-bool isMethod(string name) {
-  string methods[] = {
-    "isClosed",
-    "isOpen",
-    "close",
-    "valueOf",
-    "toString",
-    "close",
-    "get_free_memory",
-    "get_size",
-    "bucket_count",
-    "max_bucket_count",
-    "load_factor",
-    "max_load_factor",
-    "isData"
-  };
-  set<string> method_set(methods, methods + sizeof(methods) / sizeof(methods[0]));
+// Holds a concurrent file's lock for as long as it is in scope. Does
+// nothing for any other file.
+class FileLock {
+  SharedMap *map;
+  bool exclusive;
+public:
+  FileLock(SharedMap *map, bool exclusive) : map(map), exclusive(exclusive) {
+    map->lock_file(exclusive);
+  }
+  ~FileLock() { map->unlock_file(exclusive); }
+};
 
-  return method_set.find(name) != method_set.end();
+// Calls a method both kinds of table have on whichever the file uses.
+#define TABLE(self, call) ((self)->flat_map ? (self)->flat_map->call : (self)->property_map->call)
+
+// One bit per name length that occurs among the reserved names. Almost
+// every data key is rejected by this mask alone; the rest compare
+// against the few names of matching length.
+#define METHOD_LENGTH_BIT(name, ...) | (1ull << (sizeof(name) - 1))
+static const uint64_t method_name_lengths =
+  0 SHARED_MAP_METHODS(METHOD_LENGTH_BIT) RESERVED_NAMES(METHOD_LENGTH_BIT);
+#undef METHOD_LENGTH_BIT
+
+inline bool isMethod(boost::string_ref name) {
+  if (name.size() >= 64 || !(method_name_lengths & (1ull << name.size())))
+    return false;
+#define MATCH_METHOD(method_name, ...)                                  \
+  if (name.size() == sizeof(method_name) - 1 &&                         \
+      memcmp(name.data(), method_name, sizeof(method_name) - 1) == 0)   \
+    return true;
+  SHARED_MAP_METHODS(MATCH_METHOD)
+  RESERVED_NAMES(MATCH_METHOD)
+#undef MATCH_METHOD
+  return false;
 }
 
 const char *Cell::c_str() {
   if (type() != STRING_TYPE)
     throw WrongPropertyType();
- return cell_value.string_value.c_str();
+ return string_value().c_str();
+}
+
+// The bytes of a string, binary or compressed cell.
+const char *Cell::data() {
+  if (!has_storage() && !is_interned())
+    throw WrongPropertyType();
+  return string_value().data();
+}
+
+size_t Cell::size() {
+  if (!has_storage() && !is_interned())
+    throw WrongPropertyType();
+  return string_value().size();
 }
 
 Cell::operator string() {
   if (type() != STRING_TYPE)
     throw WrongPropertyType();
-  return cell_value.string_value.c_str();
+  return string_value().c_str();
 }
 
 Cell::operator double() {
@@ -195,426 +1282,2547 @@ Cell::operator double() {
   return cell_value.number_value;
 }
 
+Cell::operator bool() {
+  if (type() != BOOLEAN_TYPE)
+    throw WrongPropertyType();
+  return cell_value.boolean_value;
+}
+
 Cell::Cell(const Cell &cell) {
   cell_type = cell.cell_type;
-  if (cell.cell_type == STRING_TYPE) {
+  cell_encoding = cell.cell_encoding;
+  if (cell.has_storage()) {
     new (&cell_value.string_value)(shared_string)(cell.cell_value.string_value, cell.cell_value.string_value.get_allocator());
-  } else { // is a number type
+  } else if (cell.is_interned()) {
+    new (&cell_value.interned_value) bip::offset_ptr<InternedString>(cell.cell_value.interned_value);
+    cell_value.interned_value->second.refs++;
+  } else if (cell.type() == NUMBER_TYPE) {
     cell_value.number_value = cell.cell_value.number_value;
+  } else if (cell.type() == BOOLEAN_TYPE) {
+    cell_value.boolean_value = cell.cell_value.boolean_value;
   }
 }
 
-NAN_PROPERTY_SETTER(SharedMap::PropSetter) {
-  auto self = Nan::ObjectWrap::Unwrap<SharedMap>(info.This());
-  if (self->readonly) {
-    Nan::ThrowError("Read-only object.");
-    return;
-  }
-
-  if (self->closed) {
-    Nan::ThrowError("Cannot write to closed object.");
-    return;
+// Takes over the string rather than copying it, for tables that move
+// their entries. An interned string's reference moves with it.
+Cell::Cell(Cell &&cell) {
+  cell_type = cell.cell_type;
+  cell_encoding = cell.cell_encoding;
+  if (cell.has_storage()) {
+    new (&cell_value.string_value)(shared_string)(boost::move(cell.cell_value.string_value));
+  } else if (cell.is_interned()) {
+    new (&cell_value.interned_value) bip::offset_ptr<InternedString>(cell.cell_value.interned_value);
+    cell.cell_type = UNINITIALIZED;
+  } else if (cell.type() == NUMBER_TYPE) {
+    cell_value.number_value = cell.cell_value.number_value;
+  } else if (cell.type() == BOOLEAN_TYPE) {
+    cell_value.boolean_value = cell.cell_value.boolean_value;
   }
+}
 
-  if (property->IsSymbol()) {
-    Nan::ThrowError("Symbol properties are not supported.");
-    return;
+// Overwrites reuse the existing string's storage when the new value
+// fits in its capacity.
+void Cell::assign_storage(char type, const char *value, size_t length, char_allocator allocator) {
+  if (has_storage()) {
+    cell_value.string_value.assign(value, value + length);
+  } else {
+    release();
+    new (&cell_value.string_value)(shared_string)(value, length, allocator);
   }
+  set_type(type);
+}
 
-  size_t data_length = sizeof(Cell);
+void Cell::assign(const char *value, size_t length, char_allocator allocator) {
+  assign_storage(STRING_TYPE, value, length, allocator);
+}
 
-  try {
-    Cell *c;
-    while(true) {
-      try {
-        if (value->IsString()) {
-          v8::String::Utf8Value data(value);
-          data_length += data.length();
-          char_allocator allocer(self->map_seg->get_segment_manager());
-          c = new Cell(string(*data).c_str(), allocer);
-        } else if (value->IsNumber()) {
-          data_length += sizeof(double);
-          c = new Cell(Nan::To<double>(value).FromJust());
-        } else {
-          Nan::ThrowError("Value must be a string or number.");
-          return;
-        }
+void Cell::assign(binary_t, const char *value, size_t length, char_allocator allocator) {
+  assign_storage(BINARY_TYPE, value, length, allocator);
+}
 
-        v8::String::Utf8Value prop(property);
-        data_length += prop.length();
-        shared_string *string_key;
-        char_allocator allocer(self->map_seg->get_segment_manager());
-        string_key = new shared_string(string(*prop).c_str(), allocer);
-        auto pair = self->property_map->insert({ *string_key, *c });
-        if (!pair.second) {
-          self->property_map->erase(*string_key);
-          self->property_map->insert({ *string_key, *c });
-        }
-        break;
-      } catch(length_error) {
-        self->grow(data_length * 2);
-      } catch(bip::bad_alloc) {
-        self->grow(data_length * 2);
-      }
-    }
-  } catch(FileTooLarge) {
-    Nan::ThrowError("File grew too large.");
-  }
-  info.GetReturnValue().Set(value);
+void Cell::assign(compressed_t compressed, const char *value, size_t length,
+                  char_allocator allocator) {
+  assign_storage(COMPRESSED_TYPE | compressed.flags, value, length, allocator);
 }
 
-#define STRINGINDEX                                             \
-  ostringstream ss;                                             \
-  ss << index;                                                  \
-  auto prop = Nan::New<v8::String>(ss.str()).ToLocalChecked()
+void Cell::assign(const double value) {
+  release();
+  set_type(NUMBER_TYPE);
+  cell_value.number_value = value;
+}
 
-NAN_INDEX_GETTER(SharedMap::IndexGetter) {
-  STRINGINDEX;
-  SharedMap::PropGetter(prop, info);
+void Cell::assign(const bool value) {
+  release();
+  set_type(BOOLEAN_TYPE);
+  cell_value.boolean_value = value;
 }
 
-NAN_INDEX_SETTER(SharedMap::IndexSetter) {
-  STRINGINDEX;
-  SharedMap::PropSetter(prop, value, info);
+void Cell::assign(nullptr_t) {
+  release();
+  set_type(NULL_TYPE);
 }
 
-NAN_INDEX_QUERY(SharedMap::IndexQuery) {
-  STRINGINDEX;
-  SharedMap::PropQuery(prop, info);
+// Refers to an interned string. The new reference is counted before the
+// old one is dropped, in case they are the same.
+void Cell::assign(InternedString *value) {
+  value->second.refs++;
+  release();
+  new (&cell_value.interned_value) bip::offset_ptr<InternedString>(value);
+  set_type(INTERNED_TYPE | (value->second.type & ~TYPE_MASK));
 }
 
-NAN_INDEX_DELETER(SharedMap::IndexDeleter) {
-  STRINGINDEX;
-  SharedMap::PropDeleter(prop, info);
+// The union can't know which member is live, so release the string's
+// segment storage here or it is orphaned on every erase.
+void Cell::release() {
+  if (has_storage())
+    cell_value.string_value.~shared_string();
+  else if (is_interned())
+    cell_value.interned_value->second.refs--;
+  cell_type = UNINITIALIZED;
 }
 
-NAN_INDEX_ENUMERATOR(SharedMap::IndexEnumerator) {
-  info.GetReturnValue().Set(Nan::New<v8::Array>(v8::None));
+Cell::~Cell() {
+  release();
 }
 
-NAN_METHOD(SharedMap::inspect) {
-  info.GetReturnValue().Set(v8::None);
+// Looks name up on an optional options object.
+v8::Local<v8::Value> getOption(v8::Local<v8::Value> options, const char *name) {
+  if (!options->IsObject())
+    return Nan::Undefined();
+  return Nan::Get(options.As<v8::Object>(), Nan::New(name).ToLocalChecked()).ToLocalChecked();
 }
 
-NAN_PROPERTY_GETTER(SharedMap::PropGetter) {
-  v8::String::Utf8Value data(info.Data());
-  v8::String::Utf8Value src(property);
-  if (property->IsSymbol() || string(*data) == "prototype") {
-    return;
+// Finds the bytes behind a Buffer, TypedArray, DataView or ArrayBuffer.
+bool binaryContents(v8::Local<v8::Value> value, const char *&data, size_t &length) {
+  if (value->IsArrayBufferView()) {
+    auto view = value.As<v8::ArrayBufferView>();
+    data = static_cast<const char *>(view->Buffer()->GetContents().Data()) + view->ByteOffset();
+    length = view->ByteLength();
+    return true;
   }
-
-  if (string(*src) == "inspect") {
-    v8::Local<v8::FunctionTemplate> tmpl = Nan::New<v8::FunctionTemplate>(inspect);
-    v8::Local<v8::Function> fn = Nan::GetFunction(tmpl).ToLocalChecked();
-    fn->SetName(Nan::New("inspect").ToLocalChecked());
-    info.GetReturnValue().Set(fn);
-    return;
+  if (value->IsArrayBuffer()) {
+    auto buffer = value.As<v8::ArrayBuffer>();
+    data = static_cast<const char *>(buffer->GetContents().Data());
+    length = buffer->ByteLength();
+    return true;
   }
+  return false;
+}
 
-  if (!property->IsNull() && isMethod(string(*src))) {
+// Writes a value for key, overwriting in place when the key exists.
+// The arguments are those of the matching Cell constructor.
+template <typename... Value>
+void SharedMap::store(boost::string_ref key, Value... value) {
+  size_t hash = hasher()(key);
+  Cell *existing = find(key, hash);
+  if (existing) {
+    // Overwrite in place; the key and its node stay untouched.
+    existing->assign(value...);
     return;
   }
-
-  auto self = Nan::ObjectWrap::Unwrap<SharedMap>(info.This());
-  if (self->closed) {
-    Nan::ThrowError("Cannot read from closed object.");
+  if (flat_map) {
+    flat_map->emplace(key, hash, value...);
     return;
   }
+  // Build the key and Cell directly in the map's node: one segment
+  // allocation per string, nothing on the process heap.
+  char_allocator allocer(map_seg->get_segment_manager());
+  property_map->emplace(boost::unordered::piecewise_construct,
+                        boost::make_tuple(key.data(), key.size(), allocer),
+                        boost::make_tuple(value...));
+}
 
-  // If the map doesn't have it, let v8 continue the search.
-  auto pair = self->property_map->find<char_string, hasher, s_equal_to>
-    (*src, hasher(), s_equal_to());
+// Finds the table in the file, whichever kind it is, and the intern
+// table if there is one.
+void SharedMap::find_table() {
+  flat_map = map_seg->find<FlatHash>("flat_properties").first;
+  property_map = flat_map ? NULL : map_seg->find<PropertyHash>("properties").first;
+  intern_table = map_seg->find<InternTable>("interned_strings").first;
+  compression = map_seg->find<CompressionSettings>("compression").first;
+  lock = map_seg->find<FileMutex>("concurrent_lock").first;
+  live = map_seg->find<LiveState>("live_state").first;
+}
 
-  if (pair == self->property_map->end())
-    return;
-  Cell *c = &pair->second;
-  if (c->type() == STRING_TYPE) {
-    info.GetReturnValue().Set(Nan::New<v8::String>(c->c_str()).ToLocalChecked());
-  } else if (c->type() == NUMBER_TYPE) {
-    info.GetReturnValue().Set((double)*c);
+// Takes a concurrent file's lock, shared for reading or exclusive for
+// writing. Another process may have grown the file since this one last
+// looked, so it is remapped if the size in the segment no longer
+// matches what is mapped. That size only changes under the exclusive
+// lock, so it holds still until the lock is released.
+//
+// The writer of a live file takes no lock; it makes the sequence odd
+// for the duration instead.
+void SharedMap::lock_file(bool exclusive) {
+  if (live && exclusive) {
+    live->sequence.store(live->sequence.load(memory_order_relaxed) + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
   }
+  if (lock == NULL)
+    return;
+  if (exclusive)
+    lock->lock();
+  else
+    lock->lock_sharable();
+  if (map_seg->get_size() != mapped_size)
+    remap();
 }
 
-NAN_PROPERTY_QUERY(SharedMap::PropQuery) {
-  v8::String::Utf8Value src(property);
-
-  if (isMethod(string(*src))) {
-    info.GetReturnValue().Set(Nan::New<v8::Integer>(v8::ReadOnly | v8::DontEnum | v8::DontDelete));
+// Releases the lock through the current mapping, which may not be the
+// one it was taken through.
+void SharedMap::unlock_file(bool exclusive) {
+  if (live && exclusive)
+    live->sequence.store(live->sequence.load(memory_order_relaxed) + 1, memory_order_release);
+  if (lock == NULL)
     return;
-  }
-  auto self = Nan::ObjectWrap::Unwrap<SharedMap>(info.This());
+  if (exclusive)
+    lock->unlock();
+  else
+    lock->unlock_sharable();
+}
 
-  if (self->readonly) {
-    info.GetReturnValue().Set(Nan::New<v8::Integer>(v8::ReadOnly | v8::DontDelete));
+// Maps the whole file again. The lock's state is kept in the file, so a
+// lock taken through the old mapping is still held. The size is read
+// first: the file is always at least that big, even if a live writer
+// grows it meanwhile.
+void SharedMap::remap() {
+  size_t size = map_seg->get_size();
+  delete map_seg;
+  release_address_space();
+  if (readonly && lock == NULL)
+    map_seg = new bip::managed_mapped_file(bip::open_read_only, file_name.c_str());
+  else
+    map_seg = new bip::managed_mapped_file(bip::open_only, file_name.c_str());
+  find_table();
+  mapped_size = file_size = size;
+}
+
+// Whether the process that writes a live file is still running.
+static bool writerAlive(int32_t pid) {
+#if defined(_WIN32)
+  return pid != 0;
+#else
+  return pid != 0 && (kill(pid, 0) == 0 || errno == EPERM);
+#endif
+}
+
+// Runs read, which copies what it needs out of a live file, until it
+// has seen the file between writes: with the same even sequence before
+// and after. read returns false when what it found didn't add up; that
+// only stands if the sequence says nothing changed, in which case the
+// file is corrupt and this returns false too. So does a writer that
+// died halfway through a write.
+template <typename Read>
+bool SharedMap::read_live(Read read) {
+  for (unsigned tries = 1; ; tries++) {
+    uint64_t before = live->sequence.load(memory_order_acquire);
+    if (before & 1) {
+      if (tries % 1024 == 0 && !writerAlive(live->writer))
+        return false;
+      this_thread::yield();
+      continue;
+    }
+    if (map_seg->get_size() != mapped_size) { // The writer grew the file.
+      remap();
+      continue;
+    }
+    char *segment = static_cast<char *>(map_seg->get_address());
+    bool whole = read(Span(segment, mapped_size - live->segment_offset));
+    atomic_thread_fence(memory_order_acquire);
+    if (live->sequence.load(memory_order_relaxed) == before)
+      return whole;
+  }
+}
+
+// Copies key's value out of a live file into cell, setting found if
+// it's there. Returns false if the file is corrupt.
+bool SharedMap::find_live(boost::string_ref key, size_t hash, CopiedCell &cell, bool &found) {
+  return read_live([&](const Span &span) -> bool {
+    bool torn = false;
+    auto entry = flat_map->find(key, hash, span, torn);
+    found = entry && cell.copy(entry->second, span);
+    return !torn && (entry == NULL || found);
+  });
+}
+
+// Looks key up in whichever table the file has.
+Cell *SharedMap::find(boost::string_ref key, size_t hash) {
+  if (flat_map) {
+    auto entry = flat_map->find(key, hash);
+    return entry ? &entry->second : NULL;
+  }
+  auto pair = property_map->find(key, precomputed_hash{hash}, s_equal_to());
+  return pair == property_map->end() ? NULL : &pair->second;
+}
+
+void SharedMap::erase(boost::string_ref key) {
+  if (flat_map) {
+    auto entry = flat_map->find(key, hasher()(key));
+    if (entry)
+      flat_map->erase(entry);
+    return;
+  }
+  auto pair = property_map->find(key, hasher(), s_equal_to());
+  if (pair != property_map->end())
+    property_map->erase(pair);
+}
+
+// Finds value in the intern table, adding it if it's new. Its count
+// only goes up once a Cell refers to it.
+InternedString *SharedMap::intern(const char *value, size_t length) {
+  boost::string_ref ref(value, length);
+  auto found = intern_table->find(ref, hasher(), s_equal_to());
+  if (found != intern_table->end())
+    return &*found;
+  char_allocator allocer(map_seg->get_segment_manager());
+  return &*intern_table->emplace(boost::unordered::piecewise_construct,
+                                 boost::make_tuple(value, length, allocer),
+                                 boost::make_tuple(0, stringType(value, length))).first;
+}
+
+// Drops interned strings that no Cell refers to any more.
+void SharedMap::sweep_interned() {
+  if (intern_table == NULL)
+    return;
+  for (auto it = intern_table->begin(); it != intern_table->end();) {
+    if (it->second.refs == 0)
+      it = intern_table->erase(it);
+    else
+      ++it;
+  }
+}
+
+// The preset dictionary values are compressed with, if any.
+boost::string_ref SharedMap::dictionary() {
+  if (frozen)
+    return frozen->dictionary();
+  if (compression)
+    return boost::string_ref(compression->dictionary.data(), compression->dictionary.size());
+  return boost::string_ref();
+}
+
+// Decompresses a COMPRESSED_TYPE value into inflated. Returns false
+// when the value is corrupt.
+bool SharedMap::inflate(const char *data, size_t length) {
+  if (compressor == NULL)
+    compressor = new Compressor();
+  boost::string_ref words = dictionary();
+  return compressor->inflate(data, length, words.data(), words.size(), inflated);
+}
+
+// Upper bound on the table's own storage for keys entries.
+size_t SharedMap::table_bytes(size_t keys) {
+  if (flat_map)
+    return FlatHash::bytesFor(keys, flat_map->max_load_factor());
+  return bucketBytes(keys, property_map->max_load_factor());
+}
+
+// Runs op, growing the file and retrying whenever the segment runs out
+// of room. grow() remaps the file, so op must not hold on to pointers
+// into the segment from a previous attempt.
+template <typename Op>
+void SharedMap::with_room(size_t wanted, Op op) {
+  while(true) {
+    try {
+      op();
+      return;
+    } catch(length_error) {
+      grow(wanted * 2);
+    } catch(bip::bad_alloc) {
+      grow(wanted * 2);
+    }
+  }
+}
+
+// Grows the file up front so that at least bytes more are free.
+void SharedMap::make_room(size_t bytes) {
+  size_t free_memory = map_seg->get_free_memory();
+  if (free_memory < bytes)
+    grow(bytes - free_memory);
+}
+
+// Writes key = value, growing the file as needed. Throws
+// WrongPropertyType for values a Cell can't hold and FileTooLarge when
+// the file would grow past max_file_size.
+void SharedMap::set(boost::string_ref key, v8::Local<v8::Value> value) {
+  const char *bytes;
+  size_t byte_length = 0;
+  bool is_binary = binaryContents(value, bytes, byte_length);
+  if (!value->IsString() && !value->IsNumber() && !value->IsBoolean() && !value->IsNull() && !is_binary)
+    throw WrongPropertyType();
+
+  Nan::Utf8String data(value->IsString() ? value : v8::Local<v8::Value>(Nan::EmptyString()));
+  size_t data_length = sizeof(Cell) + key.size() + data.length() + byte_length;
+
+  // Compress once, up front, rather than on every retry. Interned
+  // strings are shared instead.
+  bool packed = false;
+  compressed_t compressed = {0};
+  if (value->IsString() && compression && !intern_table &&
+      (size_t)data.length() > compression->threshold) {
+    if (compressor == NULL)
+      compressor = new Compressor();
+    boost::string_ref words = dictionary();
+    packed = compressor->deflate(*data, data.length(), words.data(), words.size(), deflated);
+    compressed.flags = stringType(*data, data.length()) & ~TYPE_MASK;
+  }
+
+  with_room(data_length, [&]() {
+    if (packed) {
+      char_allocator allocer(map_seg->get_segment_manager());
+      store(key, compressed, deflated.data(), deflated.size(), allocer);
+    } else if (value->IsString()) {
+      char_allocator allocer(map_seg->get_segment_manager());
+      if (intern_table && (size_t)data.length() > inlineCapacity(allocer))
+        store(key, intern(*data, data.length()));
+      else
+        store(key, (const char *)*data, (size_t)data.length(), allocer);
+    } else if (is_binary) {
+      char_allocator allocer(map_seg->get_segment_manager());
+      store(key, binary, bytes, byte_length, allocer);
+    } else if (value->IsBoolean()) {
+      store(key, Nan::To<bool>(value).FromJust());
+    } else if (value->IsNull()) {
+      store(key, nullptr);
+    } else {
+      store(key, Nan::To<double>(value).FromJust());
+    }
+  });
+}
+
+// The checked set() behind the setter, also used by sharded objects.
+// Returns false once it has thrown.
+bool SharedMap::put(boost::string_ref key, v8::Local<v8::Value> value) {
+  if (readonly) {
+    Nan::ThrowError("Read-only object.");
+    return false;
+  }
+
+  if (closed) {
+    Nan::ThrowError("Cannot write to closed object.");
+    return false;
+  }
+
+  if (closing) {
+    Nan::ThrowError("Cannot write to an object that is closing.");
+    return false;
+  }
+
+  FileLock guard(this, true);
+  try {
+    set(key, value);
+  } catch(WrongPropertyType) {
+    Nan::ThrowError("Value must be a string, number, boolean, null or binary data.");
+    return false;
+  } catch(FileTooLarge) {
+    Nan::ThrowError("File grew too large.");
+    return false;
+  }
+  return true;
+}
+
+NAN_PROPERTY_SETTER(SharedMap::PropSetter) {
+  if (property->IsSymbol()) {
+    Nan::ThrowError("Symbol properties are not supported.");
+    return;
+  }
+
+  auto self = Nan::ObjectWrap::Unwrap<SharedMap>(info.This());
+  Nan::Utf8String prop(property);
+  if (self->put(boost::string_ref(*prop, prop.length()), value))
+    info.GetReturnValue().Set(value);
+}
+
+// Segment bytes a value will take outside its Cell.
+size_t storedSize(v8::Local<v8::Value> value) {
+  const char *bytes;
+  size_t byte_length = 0;
+  if (value->IsString())
+    return value.As<v8::String>()->Utf8Length();
+  binaryContents(value, bytes, byte_length);
+  return byte_length;
+}
+
+// Adds a pair for gatherPairs(), with the key converted to a string.
+// Returns false once it has thrown.
+static bool addPair(vector<v8::Local<v8::Value>> &keys, vector<v8::Local<v8::Value>> &values,
+                    v8::Local<v8::Value> key, v8::Local<v8::Value> value) {
+  if (key->IsSymbol()) {
+    Nan::ThrowError("Symbol properties are not supported.");
+    return false;
+  }
+  v8::Local<v8::String> name;
+  if (!Nan::To<v8::String>(key).ToLocal(&name))
+    return false;
+  keys.push_back(name);
+  values.push_back(value);
+  return true;
+}
+
+// Gathers setMany()'s pairs from an object, a Map, an array of [key,
+// value] arrays or a flat array of alternating keys and values. Keys
+// come back as strings. This is where any of the caller's code runs,
+// from getters or a key's toString(), so it happens before the file is
+// locked. Returns false once it has thrown.
+bool gatherPairs(v8::Local<v8::Value> source, vector<v8::Local<v8::Value>> &keys,
+                 vector<v8::Local<v8::Value>> &values) {
+  v8::Local<v8::Value> key, value;
+  if (source->IsMap() || source->IsArray()) {
+    auto list = source->IsMap() ? source.As<v8::Map>()->AsArray() : source.As<v8::Array>();
+    uint32_t length = list->Length();
+    v8::Local<v8::Value> first;
+    if (length > 0 && !Nan::Get(list, 0).ToLocal(&first))
+      return false;
+    if (length > 0 && first->IsArray()) {
+      for (uint32_t i = 0; i < length; i++) {
+        v8::Local<v8::Value> pair;
+        if (!Nan::Get(list, i).ToLocal(&pair))
+          return false;
+        if (!pair->IsArray()) {
+          Nan::ThrowError("setMany needs every pair to be a [key, value] array.");
+          return false;
+        }
+        if (!Nan::Get(pair.As<v8::Object>(), 0).ToLocal(&key) ||
+            !Nan::Get(pair.As<v8::Object>(), 1).ToLocal(&value) ||
+            !addPair(keys, values, key, value))
+          return false;
+      }
+    } else if (length % 2 == 0) {
+      for (uint32_t i = 0; i < length; i += 2) {
+        if (!Nan::Get(list, i).ToLocal(&key) || !Nan::Get(list, i + 1).ToLocal(&value) ||
+            !addPair(keys, values, key, value))
+          return false;
+      }
+    } else {
+      Nan::ThrowError("setMany needs an even number of keys and values.");
+      return false;
+    }
+  } else if (source->IsObject()) {
+    auto object = source.As<v8::Object>();
+    v8::Local<v8::Array> names;
+    if (!Nan::GetOwnPropertyNames(object).ToLocal(&names))
+      return false;
+    for (uint32_t i = 0; i < names->Length(); i++) {
+      if (!Nan::Get(names, i).ToLocal(&key) || !Nan::Get(object, key).ToLocal(&value) ||
+          !addPair(keys, values, key, value))
+        return false;
+    }
+  } else {
+    Nan::ThrowError("setMany needs an object, a Map or an array of key/value pairs.");
+    return false;
+  }
+  return true;
+}
+
+// Checks that setMany() can store a value. Returns false once it has
+// thrown.
+bool checkValue(v8::Local<v8::Value> value) {
+  const char *bytes;
+  size_t byte_length;
+  if (!value->IsString() && !value->IsNumber() && !value->IsBoolean() &&
+      !value->IsNull() && !binaryContents(value, bytes, byte_length)) {
+    Nan::ThrowError("Value must be a string, number, boolean, null or binary data.");
+    return false;
+  }
+  return true;
+}
+
+NAN_METHOD(SharedMap::setMany) {
+  auto self = Nan::ObjectWrap::Unwrap<SharedMap>(info.This());
+  if (self->readonly) {
+    Nan::ThrowError("Read-only object.");
+    return;
+  }
+
+  if (self->closed) {
+    Nan::ThrowError("Cannot write to closed object.");
+    return;
+  }
+
+  if (self->closing) {
+    Nan::ThrowError("Cannot write to an object that is closing.");
+    return;
+  }
+
+  vector<v8::Local<v8::Value>> keys, values;
+  if (!gatherPairs(info[0], keys, values))
+    return;
+
+  // Check everything and size the whole batch before writing any of it.
+  for (size_t i = 0; i < values.size(); i++) {
+    if (!checkValue(values[i]))
+      return;
+  }
+  FileLock guard(self, true);
+  size_t needed = self->table_bytes(TABLE(self, size()) + keys.size());
+  for (size_t i = 0; i < keys.size(); i++)
+    needed += entry_overhead + storedSize(keys[i]) + storedSize(values[i]);
+
+  try {
+    self->make_room(needed);
+    self->with_room(needed, [&]() {
+      TABLE(self, reserve(TABLE(self, size()) + keys.size()));
+    });
+    for (size_t i = 0; i < keys.size(); i++) {
+      Nan::Utf8String key(keys[i]);
+      self->set(boost::string_ref(*key, key.length()), values[i]);
+    }
+  } catch(FileTooLarge) {
+    Nan::ThrowError("File grew too large.");
+  }
+}
+
+NAN_METHOD(SharedMap::reserve) {
+  auto self = Nan::ObjectWrap::Unwrap<SharedMap>(info.This());
+  if (self->readonly) {
+    Nan::ThrowError("Read-only object.");
+    return;
+  }
+
+  if (self->closed) {
+    Nan::ThrowError("Cannot write to closed object.");
+    return;
+  }
+
+  if (self->closing) {
+    Nan::ThrowError("Cannot write to an object that is closing.");
+    return;
+  }
+
+  double expected_keys = Nan::To<double>(info[0]).FromJust();
+  double expected_bytes = info[1]->IsUndefined() ? 0 : Nan::To<double>(info[1]).FromJust();
+  if (!(expected_keys >= 0) || !(expected_bytes >= 0)) {
+    Nan::ThrowError("reserve needs a number of keys and a number of bytes.");
+    return;
+  }
+
+  // Size the table for all the keys and the file for the new entries,
+  // growing at most once.
+  FileLock guard(self, true);
+  size_t keys = (size_t)expected_keys;
+  size_t new_keys = keys > TABLE(self, size()) ? keys - TABLE(self, size()) : 0;
+  size_t needed = self->table_bytes(keys)
+    + new_keys * entry_overhead + (size_t)expected_bytes;
+  try {
+    self->make_room(needed);
+    self->with_room(needed, [&]() {
+      TABLE(self, reserve(keys));
+    });
+  } catch(FileTooLarge) {
+    Nan::ThrowError("File grew too large.");
+  }
+}
+
+#define STRINGINDEX                                             \
+  ostringstream ss;                                             \
+  ss << index;                                                  \
+  auto prop = Nan::New<v8::String>(ss.str()).ToLocalChecked()
+
+NAN_INDEX_GETTER(SharedMap::IndexGetter) {
+  STRINGINDEX;
+  SharedMap::PropGetter(prop, info);
+}
+
+NAN_INDEX_SETTER(SharedMap::IndexSetter) {
+  STRINGINDEX;
+  SharedMap::PropSetter(prop, value, info);
+}
+
+NAN_INDEX_QUERY(SharedMap::IndexQuery) {
+  STRINGINDEX;
+  SharedMap::PropQuery(prop, info);
+}
+
+NAN_INDEX_DELETER(SharedMap::IndexDeleter) {
+  STRINGINDEX;
+  SharedMap::PropDeleter(prop, info);
+}
+
+NAN_INDEX_ENUMERATOR(SharedMap::IndexEnumerator) {
+  info.GetReturnValue().Set(Nan::New<v8::Array>(v8::None));
+}
+
+NAN_METHOD(SharedMap::inspect) {
+  info.GetReturnValue().Set(v8::None);
+}
+
+v8::Local<v8::Function> SharedMap::inspector() {
+  v8::Local<v8::FunctionTemplate> tmpl = Nan::New<v8::FunctionTemplate>(inspect);
+  v8::Local<v8::Function> fn = Nan::GetFunction(tmpl).ToLocalChecked();
+  fn->SetName(Nan::New("inspect").ToLocalChecked());
+  return fn;
+}
+
+// Hands a cell's value to result, which is either the getter's
+// ReturnValue or anything else with the same Set() overloads.
+template <typename Value, typename Result>
+void SharedMap::cellValue(Value *c, Result result) {
+  switch (c->type()) {
+  case STRING_TYPE: {
+    // One-byte strings must be Latin-1, which UTF-8 only is when it's
+    // plain ASCII. Anything else has to be decoded.
+    bool ascii = c->encoding_known() ? c->is_ascii() : isAscii(c->data(), c->size());
+    if (!ascii) {
+      result.Set(Nan::New<v8::String>(c->data(), c->size()).ToLocalChecked());
+    } else if (external_strings && c->size() >= MIN_EXTERNAL_STRING) {
+      result.Set(Nan::New(new MappedString(mapping, c->data(), c->size())).ToLocalChecked());
+    } else {
+      result.Set(Nan::NewOneByteString(reinterpret_cast<const uint8_t *>(c->data()),
+                                       c->size()).ToLocalChecked());
+    }
+    break;
+  }
+  case COMPRESSED_TYPE:
+    if (!inflate(c->data(), c->size())) {
+      Nan::ThrowError("Can't decompress a corrupt value.");
+    } else if (c->is_ascii()) {
+      result.Set(Nan::NewOneByteString(reinterpret_cast<const uint8_t *>(inflated.data()),
+                                       inflated.size()).ToLocalChecked());
+    } else {
+      result.Set(Nan::New<v8::String>(inflated.data(), inflated.size()).ToLocalChecked());
+    }
+    break;
+  case NUMBER_TYPE: {
+    // Integral numbers come back through the small integer fast path,
+    // which allocates nothing. -0 has to stay a double.
+    double number = (double)*c;
+    if (number >= INT32_MIN && number <= INT32_MAX && number == (int32_t)number &&
+        !(number == 0 && signbit(number)))
+      result.Set((int32_t)number);
+    else
+      result.Set(number);
+    break;
+  }
+  case BOOLEAN_TYPE:
+    result.Set((bool)*c);
+    break;
+  case NULL_TYPE:
+    result.SetNull();
+    break;
+  case BINARY_TYPE:
+    if (external_buffers) {
+      // Read-only files never move, so the Buffer can view the mapping
+      // directly. It keeps the mapping alive until it is collected.
+      mapping->retain();
+      result.Set(Nan::NewBuffer(const_cast<char *>(c->data()), c->size(),
+                                SharedMapping::release_buffer, mapping).ToLocalChecked());
+    } else {
+      // A writer's mapping moves when it grows, and a reader's is
+      // read-only, so hand out a copy unless asked not to.
+      result.Set(Nan::CopyBuffer(c->data(), c->size()).ToLocalChecked());
+    }
+    break;
+  }
+}
+
+// Collects values for getMany() through the same Set() calls the getter
+// makes on its ReturnValue.
+class ArraySlot {
+  v8::Local<v8::Array> array;
+  uint32_t index;
+public:
+  ArraySlot(v8::Local<v8::Array> array, uint32_t index) : array(array), index(index) {}
+  template <typename T> void Set(v8::Local<T> value) { Nan::Set(array, index, value); }
+  void Set(double value) { Set(Nan::New(value)); }
+  void Set(int32_t value) { Set(Nan::New(value)); }
+  void Set(bool value) { Set(Nan::New(value)); }
+  void SetNull() { Set(Nan::Null()); }
+};
+
+// The lookup behind the getter, also used by sharded objects. Hands
+// key's value to result, or leaves it alone if the map doesn't have it.
+template <typename Result>
+void SharedMap::get(boost::string_ref key, size_t hash, Result result) {
+  if (closed) {
+    Nan::ThrowError("Cannot read from closed object.");
+    return;
+  }
+
+  if (live && readonly) {
+    CopiedCell cell;
+    bool found;
+    if (!find_live(key, hash, cell, found)) {
+      Nan::ThrowError("Live file appears to be corrupt.");
+      return;
+    }
+    if (found)
+      cellValue(&cell, result);
+    return;
+  }
+  FileLock guard(this, false);
+  if (frozen) {
+    const FrozenEntry *entry;
+    if (!frozen->find(key, hash, entry)) {
+      Nan::ThrowError("Frozen file appears to be corrupt.");
+      return;
+    }
+    if (entry == NULL)
+      return;
+    FrozenCell cell = frozen->value(entry);
+    cellValue(&cell, result);
+    return;
+  }
+  Cell *cell = find(key, hash);
+  if (cell == NULL)
+    return;
+  cellValue(cell, result);
+}
+
+NAN_PROPERTY_GETTER(SharedMap::PropGetter) {
+  // Handler data is true only for the interceptor on the prototype.
+  if (property->IsSymbol() || info.Data()->IsTrue()) {
+    return;
+  }
+
+  // Nan::Utf8String decodes into an inline buffer for all but huge
+  // keys, so the lookup below normally touches no heap at all.
+  Nan::Utf8String src(property);
+  boost::string_ref key(*src, src.length());
+
+  if (key == "inspect") {
+    info.GetReturnValue().Set(inspector());
+    return;
+  }
+
+  if (!property->IsNull() && isMethod(key)) {
+    return;
+  }
+
+  // If the map doesn't have it, let v8 continue the search.
+  auto self = Nan::ObjectWrap::Unwrap<SharedMap>(info.This());
+  self->get(key, hasher()(key), info.GetReturnValue());
+}
+
+NAN_METHOD(SharedMap::getMany) {
+  auto self = Nan::ObjectWrap::Unwrap<SharedMap>(info.This());
+  if (!info[0]->IsArray()) {
+    Nan::ThrowError("getMany needs an array of keys.");
+    return;
+  }
+
+  if (self->closed) {
+    Nan::ThrowError("Cannot read from closed object.");
+    return;
+  }
+
+  // Decode every key into one buffer and hash the lot before probing
+  // the table, so the probes run back to back.
+  auto list = info[0].As<v8::Array>();
+  uint32_t length = list->Length();
+  string key_bytes;
+  vector<boost::string_ref> keys(length);
+  vector<size_t> key_starts(length), hashes(length);
+  vector<bool> usable(length);
+  for (uint32_t i = 0; i < length; i++) {
+    auto key = Nan::Get(list, i).ToLocalChecked();
+    key_starts[i] = key_bytes.size();
+    usable[i] = !key->IsSymbol();
+    if (usable[i]) {
+      Nan::Utf8String decoded(key);
+      key_bytes.append(*decoded, decoded.length());
+    }
+  }
+  for (uint32_t i = 0; i < length; i++) {
+    size_t end = i + 1 < length ? key_starts[i + 1] : key_bytes.size();
+    keys[i] = boost::string_ref(key_bytes.data() + key_starts[i], end - key_starts[i]);
+    hashes[i] = hasher()(keys[i]);
+  }
+
+  auto results = Nan::New<v8::Array>(length);
+  if (self->live && self->readonly) {
+    for (uint32_t i = 0; i < length; i++) {
+      CopiedCell cell;
+      bool found = false;
+      if (usable[i] && !self->find_live(keys[i], hashes[i], cell, found)) {
+        Nan::ThrowError("Live file appears to be corrupt.");
+        return;
+      }
+      if (found)
+        self->cellValue(&cell, ArraySlot(results, i));
+      else
+        Nan::Set(results, i, Nan::Undefined());
+    }
+    info.GetReturnValue().Set(results);
+    return;
+  }
+
+  // Flat and frozen tables know where a key lives from the hash alone,
+  // so its cache lines can be fetched a few keys ahead of the probe.
+  FileLock guard(self, false);
+  const uint32_t ahead = 8;
+  for (uint32_t i = 0; i < ahead && i < length; i++) {
+    if (self->flat_map)
+      self->flat_map->prefetch(hashes[i]);
+    else if (self->frozen)
+      self->frozen->prefetch(hashes[i]);
+  }
+
+  for (uint32_t i = 0; i < length; i++) {
+    if (i + ahead < length) {
+      if (self->flat_map)
+        self->flat_map->prefetch(hashes[i + ahead]);
+      else if (self->frozen)
+        self->frozen->prefetch(hashes[i + ahead]);
+    }
+    if (self->frozen) {
+      const FrozenEntry *entry = NULL;
+      if (usable[i] && !self->frozen->find(keys[i], hashes[i], entry)) {
+        Nan::ThrowError("Frozen file appears to be corrupt.");
+        return;
+      }
+      if (entry == NULL) {
+        Nan::Set(results, i, Nan::Undefined());
+      } else {
+        FrozenCell cell = self->frozen->value(entry);
+        self->cellValue(&cell, ArraySlot(results, i));
+      }
+      continue;
+    }
+    Cell *cell = usable[i] ? self->find(keys[i], hashes[i]) : NULL;
+    if (cell == NULL)
+      Nan::Set(results, i, Nan::Undefined());
+    else
+      self->cellValue(cell, ArraySlot(results, i));
+  }
+  info.GetReturnValue().Set(results);
+}
+
+NAN_PROPERTY_QUERY(SharedMap::PropQuery) {
+  Nan::Utf8String src(property);
+
+  if (isMethod(boost::string_ref(*src, src.length()))) {
+    info.GetReturnValue().Set(Nan::New<v8::Integer>(v8::ReadOnly | v8::DontEnum | v8::DontDelete));
+    return;
+  }
+  auto self = Nan::ObjectWrap::Unwrap<SharedMap>(info.This());
+
+  if (self->readonly) {
+    info.GetReturnValue().Set(Nan::New<v8::Integer>(v8::ReadOnly | v8::DontDelete));
     return;
   }
     
   info.GetReturnValue().Set(Nan::New<v8::Integer>(v8::None));
 }
 
-NAN_PROPERTY_DELETER(SharedMap::PropDeleter) {
-  if (property->IsSymbol()) {
-    Nan::ThrowError("Symbol properties are not supported for delete.");
+NAN_PROPERTY_DELETER(SharedMap::PropDeleter) {
+  if (property->IsSymbol()) {
+    Nan::ThrowError("Symbol properties are not supported for delete.");
+    return;
+  }
+  
+  Nan::Utf8String src(property);
+
+  if (isMethod(boost::string_ref(*src, src.length()))) {
+    info.GetReturnValue().Set(Nan::New<v8::Boolean>(v8::None));
+    return;
+  }
+  
+  auto self = Nan::ObjectWrap::Unwrap<SharedMap>(info.This());
+  self->remove_key(boost::string_ref(*src, src.length()));
+}
+
+// The checked erase() behind the deleter, also used by sharded objects.
+void SharedMap::remove_key(boost::string_ref key) {
+  if (readonly) {
+    Nan::ThrowError("Cannot delete from read-only object.");
+    return;
+  }
+
+  if (closed) {
+    Nan::ThrowError("Cannot delete from closed object.");
+    return;
+  }
+
+  if (closing) {
+    Nan::ThrowError("Cannot delete from an object that is closing.");
+    return;
+  }
+
+  FileLock guard(this, true);
+  erase(key);
+}
+
+// Appends the map's keys to arr, for the enumerator and for sharded
+// objects. A closed map has none. Returns false once it has thrown.
+bool SharedMap::append_keys(v8::Local<v8::Array> arr) {
+  if (closed)
+    return true;
+
+  uint32_t i = arr->Length();
+  if (live && readonly) {
+    vector<string> keys;
+    if (!read_live([&](const Span &span) { return flat_map->keys(span, keys); })) {
+      Nan::ThrowError("Live file appears to be corrupt.");
+      return false;
+    }
+    for (size_t k = 0; k < keys.size(); k++)
+      arr->Set(i++, Nan::New<v8::String>(keys[k].data(), keys[k].size()).ToLocalChecked());
+    return true;
+  }
+
+  FileLock guard(this, false);
+  if (frozen) {
+    bool whole = frozen->each([&](const char *key, size_t length) {
+      arr->Set(i++, Nan::New<v8::String>(key, length).ToLocalChecked());
+    });
+    if (!whole) {
+      Nan::ThrowError("Frozen file appears to be corrupt.");
+      return false;
+    }
+  } else if (flat_map) {
+    flat_map->each([&](FlatHash::value_type &entry) {
+      arr->Set(i++, Nan::New<v8::String>(entry.first.data(), entry.first.size()).ToLocalChecked());
+    });
+  } else {
+    for (auto it = property_map->begin(); it != property_map->end(); ++it) {
+      arr->Set(i++, Nan::New<v8::String>(it->first.data(), it->first.size()).ToLocalChecked());
+    }
+  }
+  return true;
+}
+
+NAN_PROPERTY_ENUMERATOR(SharedMap::PropEnumerator) {
+  v8::Local<v8::Array> arr = Nan::New<v8::Array>();
+  auto self = Nan::ObjectWrap::Unwrap<SharedMap>(info.This());
+  if (self->append_keys(arr))
+    info.GetReturnValue().Set(arr);
+}
+
+// A frozen file has no free space and no segment to ask for its size.
+NAN_METHOD(SharedMap::get_free_memory) {
+  auto self = Nan::ObjectWrap::Unwrap<SharedMap>(info.This());
+  FileLock guard(self, false);
+  info.GetReturnValue().Set(self->frozen ? 0 : (uint32_t)self->map_seg->get_free_memory());
+}
+
+NAN_METHOD(SharedMap::get_size) {
+  auto self = Nan::ObjectWrap::Unwrap<SharedMap>(info.This());
+  FileLock guard(self, false);
+  info.GetReturnValue().Set(self->frozen ? (uint32_t)self->file_size : (uint32_t)self->map_seg->get_size());
+}
+
+#define TABLE_INFO_METHOD(name, type) NAN_METHOD(SharedMap::name) { \
+  auto self = Nan::ObjectWrap::Unwrap<SharedMap>(info.This()); \
+  FileLock guard(self, false); \
+  if (self->frozen) \
+    info.GetReturnValue().Set((type)self->frozen->name()); \
+  else \
+    info.GetReturnValue().Set((type)TABLE(self, name())); \
+}
+
+TABLE_INFO_METHOD(bucket_count, uint32_t)
+TABLE_INFO_METHOD(max_bucket_count, uint32_t)
+TABLE_INFO_METHOD(load_factor, float)
+
+// Rebuilds the bucket array with at least buckets buckets, or as few as
+// the current max load factor allows for buckets == 0. Grows the file
+// to fit the new array up front.
+void SharedMap::resize_table(size_t buckets) {
+  size_t keys = max((size_t)(buckets * TABLE(this, max_load_factor())), TABLE(this, size()));
+  size_t needed = table_bytes(keys);
+  make_room(needed);
+  with_room(needed, [&]() {
+    TABLE(this, rehash(buckets));
+  });
+}
+
+// With an argument, sets the maximum load factor and rehashes to
+// match. The factor is part of the table in the file, so later Open
+// readers see the tuned table.
+NAN_METHOD(SharedMap::max_load_factor) {
+  auto self = Nan::ObjectWrap::Unwrap<SharedMap>(info.This());
+  if (info.Length() == 0) {
+    FileLock guard(self, false);
+    if (self->frozen)
+      info.GetReturnValue().Set(self->frozen->max_load_factor());
+    else
+      info.GetReturnValue().Set((float)TABLE(self, max_load_factor()));
+    return;
+  }
+
+  if (self->readonly) {
+    Nan::ThrowError("Read-only object.");
+    return;
+  }
+
+  if (self->closed) {
+    Nan::ThrowError("Cannot write to closed object.");
+    return;
+  }
+
+  if (self->closing) {
+    Nan::ThrowError("Cannot write to an object that is closing.");
+    return;
+  }
+
+  double factor = Nan::To<double>(info[0]).FromJust();
+  if (!(factor > 0) || std::isinf(factor)) {
+    Nan::ThrowError("max_load_factor needs a positive number.");
+    return;
+  }
+
+  FileLock guard(self, true);
+  try {
+    TABLE(self, max_load_factor((float)factor));
+    self->resize_table(0);
+  } catch(FileTooLarge) {
+    Nan::ThrowError("File grew too large.");
+  }
+}
+
+NAN_METHOD(SharedMap::rehash) {
+  auto self = Nan::ObjectWrap::Unwrap<SharedMap>(info.This());
+  if (self->readonly) {
+    Nan::ThrowError("Read-only object.");
+    return;
+  }
+
+  if (self->closed) {
+    Nan::ThrowError("Cannot write to closed object.");
+    return;
+  }
+
+  if (self->closing) {
+    Nan::ThrowError("Cannot write to an object that is closing.");
+    return;
+  }
+
+  FileLock guard(self, true);
+  double buckets = Nan::To<double>(info[0]).FromJust();
+  if (!(buckets >= 0) || buckets > TABLE(self, max_bucket_count())) {
+    Nan::ThrowError("rehash needs a number of buckets.");
+    return;
+  }
+
+  try {
+    self->resize_table((size_t)buckets);
+  } catch(FileTooLarge) {
+    Nan::ThrowError("File grew too large.");
+  }
+}
+
+NAN_METHOD(SharedMap::grow_count) {
+  auto self = Nan::ObjectWrap::Unwrap<SharedMap>(info.This());
+  info.GetReturnValue().Set((double)self->grows);
+}
+
+NAN_METHOD(SharedMap::flushed_bytes) {
+  auto self = Nan::ObjectWrap::Unwrap<SharedMap>(info.This());
+  info.GetReturnValue().Set((double)self->flushed);
+}
+
+NAN_METHOD(SharedMap::Create) {
+  if (!info.IsConstructCall()) {
+    Nan::ThrowError("Create must be called as a constructor.");
+    return;
+  }
+
+  Nan::Utf8String filename(info[0]->ToString());
+  size_t file_size = (int)info[1]->Int32Value();
+  file_size *= 1024;
+  size_t initial_bucket_count = (int)info[2]->Int32Value();
+  size_t max_file_size = (int)info[3]->Int32Value();
+  max_file_size *= 1024;
+
+  if (file_size == 0) {
+    file_size = DEFAULT_FILE_SIZE;
+  }
+  // Don't open it too small.
+  if (file_size < MINIMUM_FILE_SIZE) {
+    file_size = 500;
+    max_file_size = max(file_size, max_file_size);
+  }
+  if (max_file_size == 0) {
+    max_file_size = DEFAULT_MAX_SIZE;
+  }
+
+  double growth_factor = DEFAULT_GROWTH_FACTOR;
+  size_t min_growth = DEFAULT_MIN_GROWTH;
+  auto factor_option = getOption(info[4], "growthFactor");
+  if (!factor_option->IsUndefined()) {
+    growth_factor = Nan::To<double>(factor_option).FromJust();
+    if (!(growth_factor >= 1)) {
+      Nan::ThrowError("growthFactor must be a number of at least 1.");
+      return;
+    }
+  }
+  auto step_option = getOption(info[4], "minGrowth");
+  if (!step_option->IsUndefined()) {
+    double step = Nan::To<double>(step_option).FromJust();
+    if (!(step >= 0)) {
+      Nan::ThrowError("minGrowth must be a non-negative number.");
+      return;
+    }
+    min_growth = (size_t)step * 1024;
+  }
+
+  bool intern = Nan::To<bool>(getOption(info[4], "internStrings")).FromJust();
+  bool concurrent = Nan::To<bool>(getOption(info[4], "concurrent")).FromJust();
+  bool live = Nan::To<bool>(getOption(info[4], "live")).FromJust();
+  if (concurrent && live) {
+    Nan::ThrowError("A file can't be both concurrent and live.");
+    return;
+  }
+  double compress_above = -1;
+  auto compress_option = getOption(info[4], "compressAbove");
+  if (!compress_option->IsUndefined()) {
+    compress_above = Nan::To<double>(compress_option).FromJust();
+    if (!(compress_above >= 0)) {
+      Nan::ThrowError("compressAbove must be a non-negative number.");
+      return;
+    }
+  }
+  auto dictionary_option = getOption(info[4], "compressionDictionary");
+  const char *dictionary = NULL;
+  size_t dictionary_length = 0;
+  Nan::Utf8String dictionary_text(dictionary_option->IsString() ? dictionary_option :
+                                  v8::Local<v8::Value>(Nan::EmptyString()));
+  if (dictionary_option->IsString()) {
+    dictionary = *dictionary_text;
+    dictionary_length = dictionary_text.length();
+  } else if (!dictionary_option->IsUndefined() &&
+             !binaryContents(dictionary_option, dictionary, dictionary_length)) {
+    Nan::ThrowError("compressionDictionary must be a string or binary data.");
+    return;
+  }
+  bool flat = false;
+  auto table_option = getOption(info[4], "table");
+  if (!table_option->IsUndefined()) {
+    Nan::Utf8String table(table_option);
+    flat = string(*table) == "flat";
+    if (!flat && string(*table) != "chained") {
+      Nan::ThrowError("table must be 'chained' or 'flat'.");
+      return;
+    }
+  }
+  if (live && !table_option->IsUndefined() && !flat) {
+    Nan::ThrowError("Live files need the flat table.");
+    return;
+  }
+  flat = flat || live;
+
+  // Default to 1024 buckets
+  if (initial_bucket_count == 0) {
+    initial_bucket_count = 1024;
+  }
+  if (isFrozenFile(*filename)) {
+    ostringstream error_stream;
+    error_stream << "Can't open file " << *filename << ": frozen files are read-only.";
+    Nan::ThrowError(error_stream.str().c_str());
+    return;
+  }
+
+  SharedMap *d = new SharedMap(*filename, file_size, max_file_size, growth_factor, min_growth);
+  // No more than this is mapped below, even if another process grows
+  // the file meanwhile.
+  struct stat existing;
+  if (stat(*filename, &existing) == 0)
+    d->mapped_size = existing.st_size;
+
+  try {
+    if (!concurrent && Nan::To<bool>(getOption(info[4], "reserveAddressSpace")).FromJust())
+      d->reserve_address_space();
+    d->map_seg = new bip::managed_mapped_file(bip::open_or_create,string(*filename).c_str(),
+                                              d->file_size, d->reservation);
+    // An existing file keeps its own size, which growth plans from.
+    d->file_size = d->map_seg->get_size();
+    if (concurrent)
+      d->map_seg->find_or_construct<FileMutex>("concurrent_lock")();
+    d->find_table();
+    if (live && d->live == NULL && d->property_map == NULL)
+      d->live = d->map_seg->construct<LiveState>("live_state")
+        (d->map_seg->get_size() - d->map_seg->get_segment_manager()->get_size());
+    if ((live && d->property_map) || (d->live && writerAlive(d->live->writer))) {
+      delete d->map_seg;
+      d->release_address_space();
+      ostringstream error_stream;
+      error_stream << "Can't open file " << *filename << ": ";
+      if (d->property_map)
+        error_stream << "live files need the flat table.";
+      else
+        error_stream << "it already has a live writer.";
+      Nan::ThrowError(error_stream.str().c_str());
+      return;
+    }
+    if (d->live) {
+#if !defined(_WIN32)
+      d->live->writer = getpid();
+#endif
+      if (d->live->sequence & 1) // Its last writer died halfway through.
+        d->live->sequence++;
+    }
+    // Another process may be setting up the same file, so look again
+    // once it's locked. An existing file keeps the table it has.
+    FileLock guard(d, true);
+    d->find_table();
+    if (d->flat_map == NULL && d->property_map == NULL) {
+      if (flat)
+        d->flat_map = d->map_seg->construct<FlatHash>("flat_properties")
+          (initial_bucket_count, d->map_seg->get_segment_manager());
+      else
+        d->property_map = d->map_seg->construct<PropertyHash>("properties")
+          (initial_bucket_count, hasher(), s_equal_to(), d->map_seg->get_segment_manager());
+    }
+    if (intern && d->intern_table == NULL)
+      d->intern_table = d->map_seg->construct<InternTable>("interned_strings")
+        (INTERN_BUCKETS, hasher(), s_equal_to(), d->map_seg->get_segment_manager());
+    if (compress_above >= 0 && d->compression == NULL)
+      d->compression = d->map_seg->construct<CompressionSettings>("compression")
+        ((uint64_t)compress_above, dictionary, dictionary_length,
+         char_allocator(d->map_seg->get_segment_manager()));
+    d->closed = false;
+  } catch(bip::interprocess_exception &ex){
+#if defined(__linux__)
+    if (d->reservation) { // The head was never mapped by us.
+      size_t head = bip::mapped_region::get_page_size();
+      head = (d->file_size + head - 1) / head * head;
+      munmap(d->reservation + head, d->reserved - head);
+      d->reservation = NULL;
+    }
+#endif
+    ostringstream error_stream;
+    error_stream << "Can't open file " << *filename << ": " << ex.what();
+    Nan::ThrowError(error_stream.str().c_str());
+    return;
+  }
+#if defined(__linux__)
+  if (d->reservation) {
+    d->fd = open(*filename, O_RDWR);
+    // Can't grow in place, or other processes share the file and remap
+    // it when it grows, so remap on growth instead.
+    if (d->fd < 0 || d->lock) {
+      delete d->map_seg;
+      d->release_address_space();
+      d->map_seg = new bip::managed_mapped_file(bip::open_only, *filename);
+      d->find_table();
+    }
+  }
+#endif
+  d->Wrap(info.This());
+  info.GetReturnValue().Set(info.This());
+}
+
+NAN_METHOD(SharedMap::Open) {
+  if (!info.IsConstructCall()) {
+    Nan::ThrowError("Open must be called as a constructor.");
+    return;
+  }
+
+  Nan::Utf8String filename(info[0]->ToString());
+
+  struct stat buf;
+  int s = stat(*filename, &buf);
+  if (s == -1 || !S_ISREG(buf.st_mode) || buf.st_size == 0) {
+    ostringstream error_stream;
+    error_stream << *filename;
+    if (s == -1) {
+      error_stream << ": " << strerror(errno);
+    } else if (!S_ISREG(buf.st_mode)) {
+      error_stream << " is not a regular file.";
+    } else {
+      error_stream << " is an empty file.";
+    }
+    Nan::ThrowError(error_stream.str().c_str());
+    return;
+  }
+  SharedMap *d = new SharedMap(*filename);
+  d->file_size = buf.st_size;
+
+  try {
+    bip::file_mapping file(*filename, bip::read_only);
+    auto region = new bip::mapped_region(file, bip::read_only);
+    const char *base = static_cast<const char *>(region->get_address());
+    if (FrozenTable::isFrozen(base, region->get_size())) {
+      if (!FrozenTable::isIntact(base, region->get_size())) {
+        delete region;
+        ostringstream error_stream;
+        error_stream << "File " << *filename << " appears to be corrupt (3).";
+        Nan::ThrowError(error_stream.str().c_str());
+        return;
+      }
+      d->frozen = new FrozenTable(base, region->get_size());
+      d->mapping = new SharedMapping(region);
+      d->external_strings = Nan::To<bool>(getOption(info[1], "externalStrings")).FromJust();
+      d->external_buffers = Nan::To<bool>(getOption(info[1], "externalBuffers")).FromJust();
+      d->readonly = true;
+      d->closed = false;
+      d->Wrap(info.This());
+      info.GetReturnValue().Set(info.This());
+      return;
+    }
+    delete region;
+    d->map_seg = new bip::managed_mapped_file(bip::open_read_only, string(*filename).c_str());
+    // A live or concurrent file may have grown since it was measured.
+    struct stat now;
+    if (d->map_seg->get_size() != (unsigned long)buf.st_size &&
+        (stat(*filename, &now) != 0 || d->map_seg->get_size() != (unsigned long)now.st_size)) {
+      ostringstream error_stream;
+      error_stream << "File " << *filename << " appears to be corrupt (1).";
+      Nan::ThrowError(error_stream.str().c_str());
+      return;
+    }
+    d->find_table();
+    if (d->property_map == NULL && d->flat_map == NULL) {
+      ostringstream error_stream;
+      error_stream << "File " << *filename << " appears to be corrupt (2).";
+      Nan::ThrowError(error_stream.str().c_str());
+      return;
+    }
+    if (d->lock) {
+      // Even readers write to the lock, so a concurrent file is mapped
+      // read-write. It moves whenever another process grows the file.
+      delete d->map_seg;
+      d->map_seg = new bip::managed_mapped_file(bip::open_only, string(*filename).c_str());
+      d->find_table();
+    }
+    if (d->live && (d->flat_map == NULL ||
+                    d->live->segment_offset >= bip::mapped_region::get_page_size())) {
+      ostringstream error_stream;
+      error_stream << "File " << *filename << " appears to be corrupt (4).";
+      Nan::ThrowError(error_stream.str().c_str());
+      return;
+    }
+    d->mapped_size = buf.st_size;
+  } catch(bip::interprocess_exception &ex){
+    ostringstream error_stream;
+    error_stream << "Can't open file " << *filename << ": " << ex.what();
+    Nan::ThrowError(error_stream.str().c_str());
+    return;
+  }
+  if (d->lock == NULL && d->live == NULL) { // Nothing can point into a mapping that moves.
+    d->mapping = new SharedMapping(d->map_seg);
+    d->external_strings = Nan::To<bool>(getOption(info[1], "externalStrings")).FromJust();
+    d->external_buffers = Nan::To<bool>(getOption(info[1], "externalBuffers")).FromJust();
+  }
+  d->readonly = true;
+  d->closed = false;
+  d->Wrap(info.This());
+  info.GetReturnValue().Set(info.This());
+}
+
+// Grows the file so at least needed more bytes are free. Every grow
+// remaps the whole file, so the new size is planned geometrically (by
+// growth_factor, at least min_growth) to keep the number of grows
+// logarithmic in the final size. Dirty pages are not synced here:
+// unmapping leaves them in the page cache, where the new mapping sees
+// them. Durability is left to flush() and close().
+void SharedMap::grow(size_t needed) {
+  size_t target = max((size_t)(file_size * growth_factor), file_size + min_growth);
+  target = min(max(target, file_size + needed), max_file_size);
+  if (target < file_size + needed) {
+    throw FileTooLarge();
+  }
+  size_t size = target - file_size;
+  grows++;
+#if defined(__linux__)
+  if (reservation) {
+    // Extend the mapping into the reserved range. The file's last page
+    // is mapped again so the new mapping starts on a page boundary.
+    size_t start = file_size / bip::mapped_region::get_page_size()
+      * bip::mapped_region::get_page_size();
+    if (ftruncate(fd, target) != 0 ||
+        mmap(reservation + start, target - start, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_FIXED, fd, start) == MAP_FAILED)
+      throw FileTooLarge();
+    map_seg->get_segment_manager()->grow(size);
+    file_size = target;
+    return;
+  }
+#endif
+  file_size = target;
+  delete map_seg;
+  bip::managed_mapped_file::grow(file_name.c_str(), size);
+  map_seg = new bip::managed_mapped_file(bip::open_only, file_name.c_str());
+  find_table();
+  mapped_size = map_seg->get_size();
+  closed = false;
+}
+
+// Reserves max_file_size of address space and frees its head for the
+// file, so grow() can extend the mapping in place rather than remapping
+// the whole file at a new address. Only available on Linux; elsewhere,
+// or if the reservation fails, growth remaps as usual.
+void SharedMap::reserve_address_space() {
+#if defined(__linux__)
+  struct stat file_stat;
+  if (stat(file_name.c_str(), &file_stat) == 0 && S_ISREG(file_stat.st_mode))
+    file_size = file_stat.st_size; // An existing file is mapped at its own size.
+  reserved = max(max_file_size, file_size);
+  void *base = mmap(NULL, reserved, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (base == MAP_FAILED)
+    return;
+  reservation = static_cast<char *>(base);
+  size_t head = bip::mapped_region::get_page_size();
+  head = (file_size + head - 1) / head * head;
+  munmap(reservation, head);
+#endif
+}
+
+// Unmaps the reserved range, including what grow() mapped into it.
+void SharedMap::release_address_space() {
+#if defined(__linux__)
+  if (!reservation)
+    return;
+  munmap(reservation, reserved);
+  if (fd >= 0)
+    ::close(fd);
+  reservation = NULL;
+  fd = -1;
+#endif
+}
+
+// Writes dirty pages back to the file.
+void SharedMap::sync() {
+#if defined(__linux__)
+  if (reservation) {
+    msync(reservation, file_size, MS_SYNC);
+    return;
+  }
+#endif
+  map_seg->flush();
+}
+
+// Chooses a pilot for every bucket so the keys with these mixed hashes
+// land on distinct slots, filling in header's perfect hash parameters,
+// the remap table and the entry each key goes to. Buckets are placed
+// largest first, while most slots are still free. Returns false if a
+// bucket found no pilot, so the caller can try another seed.
+static bool placePerfectHash(const vector<uint64_t> &hashes, uint64_t seed, FrozenHeader &header,
+                             vector<uint16_t> &pilots, vector<uint64_t> &remap,
+                             vector<uint64_t> &positions) {
+  // About 4n / log2(n) buckets of 16 bits each, and 1% spare slots.
+  uint64_t count = hashes.size();
+  double log_count = count > 2 ? log2((double)count) : 1;
+  uint64_t buckets = max<uint64_t>(1, (uint64_t)ceil(4 * count / log_count));
+  uint64_t dense = buckets * 3 / 10;
+  uint64_t slots = max<uint64_t>(count, (uint64_t)(count / 0.99));
+
+  vector<uint64_t> us(count), starts(buckets + 1), members(count);
+  for (uint64_t i = 0; i < count; i++) {
+    us[i] = mixHash(hashes[i] ^ seed);
+    starts[perfectBucket(us[i], buckets, dense) + 1]++;
+  }
+  for (uint64_t b = 0; b < buckets; b++)
+    starts[b + 1] += starts[b];
+  vector<uint64_t> fill(starts.begin(), starts.end() - 1);
+  for (uint64_t i = 0; i < count; i++)
+    members[fill[perfectBucket(us[i], buckets, dense)]++] = i;
+
+  vector<uint64_t> order(buckets);
+  for (uint64_t b = 0; b < buckets; b++)
+    order[b] = b;
+  stable_sort(order.begin(), order.end(), [&](uint64_t a, uint64_t b) {
+    return starts[a + 1] - starts[a] > starts[b + 1] - starts[b];
+  });
+  vector<bool> taken(slots);
+  vector<uint64_t> candidates;
+  pilots.assign(buckets, 0);
+  positions.assign(count, 0);
+  for (uint64_t b : order) {
+    uint64_t size = starts[b + 1] - starts[b];
+    if (size == 0)
+      break;
+    uint32_t pilot = 0;
+    for (; pilot <= UINT16_MAX; pilot++) {
+      candidates.clear();
+      for (uint64_t k = starts[b]; k < starts[b + 1]; k++) {
+        uint64_t slot = perfectSlot(us[members[k]], pilot, seed, slots);
+        if (taken[slot] || find(candidates.begin(), candidates.end(), slot) != candidates.end())
+          break;
+        candidates.push_back(slot);
+      }
+      if (candidates.size() == size)
+        break;
+    }
+    if (pilot > UINT16_MAX)
+      return false;
+    pilots[b] = pilot;
+    for (uint64_t k = 0; k < size; k++) {
+      taken[candidates[k]] = true;
+      positions[members[starts[b] + k]] = candidates[k];
+    }
+  }
+
+  // Keys past the last entry move into the holes left below it.
+  remap.assign(slots - count, 0);
+  uint64_t hole = 0;
+  for (uint64_t i = 0; i < count; i++) {
+    if (positions[i] < count)
+      continue;
+    while (taken[hole])
+      hole++;
+    remap[positions[i] - count] = hole;
+    positions[i] = hole++;
+  }
+  header.buckets = buckets;
+  header.dense_buckets = dense;
+  header.slots = slots;
+  header.seed = seed;
+  return true;
+}
+
+// Writes every entry to path in the frozen layout, indexed by a perfect
+// hash if asked and one can be found, or else by a directory. Throws
+// runtime_error when the file can't be written.
+void SharedMap::write_frozen(const string &path, bool perfect) {
+  struct Source {
+    uint64_t hash;
+    boost::string_ref key;
+    Cell *cell;
+    bool operator <(const Source &other) const { return hash < other.hash; }
+  };
+  vector<Source> sources;
+  sources.reserve(TABLE(this, size()));
+  auto add = [&](const shared_string &key, Cell &cell) {
+    boost::string_ref ref(key.data(), key.size());
+    sources.push_back(Source{mixHash(hasher()(ref)), ref, &cell});
+  };
+  if (flat_map) {
+    flat_map->each([&](FlatHash::value_type &entry) { add(entry.first, entry.second); });
+  } else {
+    for (auto it = property_map->begin(); it != property_map->end(); ++it)
+      add(it->first, it->second);
+  }
+  sort(sources.begin(), sources.end());
+
+  FrozenHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, FROZEN_MAGIC, sizeof(header.magic));
+  header.version = FROZEN_VERSION;
+  header.count = sources.size();
+
+  vector<uint16_t> pilots;
+  vector<uint64_t> remap, positions, directory;
+  if (perfect && !sources.empty()) {
+    vector<uint64_t> hashes(sources.size());
+    for (size_t i = 0; i < sources.size(); i++)
+      hashes[i] = sources[i].hash;
+    for (uint64_t seed = 1; seed <= 8; seed++) {
+      if (placePerfectHash(hashes, seed, header, pilots, remap, positions)) {
+        header.pilots = sizeof(header);
+        break;
+      }
+    }
+  }
+  uint64_t slots = 0;
+  if (header.pilots) {
+    vector<Source> placed(sources.size());
+    for (size_t i = 0; i < sources.size(); i++)
+      placed[positions[i]] = sources[i];
+    sources.swap(placed);
+    header.remap = header.pilots + (pilots.size() * sizeof(uint16_t) + 7) / 8 * 8;
+    header.entries = header.remap + remap.size() * sizeof(uint64_t);
+  } else {
+    // About two entries per directory slot.
+    while (((uint64_t)4 << header.directory_bits) <= header.count && header.directory_bits < 40)
+      header.directory_bits++;
+    slots = (uint64_t)1 << header.directory_bits;
+    header.directory = sizeof(header);
+    header.entries = header.directory + (slots + 1) * sizeof(uint64_t);
+    directory.resize(slots + 1);
+  }
+  header.heap = header.entries + header.count * sizeof(FrozenEntry);
+
+  vector<FrozenEntry> entries(sources.size());
+  vector<bool> value_in_heap(sources.size());
+  // Interned strings go in the heap once, for all the keys sharing them.
+  boost::unordered_map<const InternedString *, uint64_t> interned_offsets;
+  uint64_t heap_end = header.heap;
+  uint64_t slot = 0;
+  for (size_t i = 0; i < sources.size(); i++) {
+    uint64_t entry_slot = header.directory_bits ? sources[i].hash >> (64 - header.directory_bits) : 0;
+    while (!header.pilots && slot <= entry_slot)
+      directory[slot++] = i;
+    FrozenEntry &entry = entries[i];
+    memset(&entry, 0, sizeof(entry));
+    Cell *cell = sources[i].cell;
+    bool bytes = cell->type() == STRING_TYPE || cell->type() == BINARY_TYPE ||
+      cell->type() == COMPRESSED_TYPE;
+    if (sources[i].key.size() > UINT32_MAX || (bytes && cell->size() > UINT32_MAX))
+      throw runtime_error("Keys and values over 4GB can't be frozen.");
+    entry.hash = sources[i].hash;
+    entry.key_length = sources[i].key.size();
+    if (entry.key_length <= FROZEN_INLINE_SIZE) {
+      memcpy(entry.key.bytes, sources[i].key.data(), entry.key_length);
+    } else {
+      entry.key.offset = heap_end;
+      heap_end += entry.key_length;
+    }
+    entry.type = cell->type();
+    switch (cell->type()) {
+    case STRING_TYPE:
+      // Cells from older files learn their encoding here, once.
+      entry.type = cell->encoding_known() ?
+        STRING_TYPE | ENCODING_KNOWN | (cell->is_ascii() ? ASCII_ENCODING : 0) :
+        stringType(cell->data(), cell->size());
+      // Fall through
+    case BINARY_TYPE:
+    case COMPRESSED_TYPE: // Stays compressed, with its encoding flags.
+      if (cell->type() == COMPRESSED_TYPE)
+        entry.type = COMPRESSED_TYPE | ENCODING_KNOWN | (cell->is_ascii() ? ASCII_ENCODING : 0);
+      entry.value_length = cell->size();
+      if (entry.value_length <= FROZEN_INLINE_SIZE) {
+        memcpy(entry.value.bytes, cell->data(), entry.value_length);
+      } else if (cell->interned() && interned_offsets.count(cell->interned())) {
+        entry.value.offset = interned_offsets[cell->interned()];
+      } else {
+        if (cell->interned())
+          interned_offsets[cell->interned()] = heap_end;
+        entry.value.offset = heap_end;
+        heap_end += entry.value_length;
+        value_in_heap[i] = true;
+      }
+      break;
+    case NUMBER_TYPE:
+      entry.value.number = (double)*cell;
+      break;
+    case BOOLEAN_TYPE:
+      entry.value.boolean = (bool)*cell;
+      break;
+    }
+  }
+  while (!header.pilots && slot <= slots)
+    directory[slot++] = sources.size();
+  boost::string_ref words = dictionary();
+  header.dictionary = heap_end;
+  header.dictionary_length = words.size();
+  header.file_size = heap_end + words.size();
+
+  FILE *out = fopen(path.c_str(), "wb");
+  if (out == NULL)
+    throw runtime_error("Can't write " + path + ": " + strerror(errno));
+  bool written = fwrite(&header, sizeof(header), 1, out) == 1;
+  if (header.pilots) {
+    pilots.resize((header.remap - header.pilots) / sizeof(uint16_t)); // Pads to 8 bytes.
+    written = written &&
+      fwrite(pilots.data(), sizeof(uint16_t), pilots.size(), out) == pilots.size() &&
+      (remap.empty() || fwrite(remap.data(), sizeof(uint64_t), remap.size(), out) == remap.size());
+  } else {
+    written = written &&
+      fwrite(directory.data(), sizeof(uint64_t), directory.size(), out) == directory.size();
+  }
+  written = written &&
+    (entries.empty() ||
+     fwrite(entries.data(), sizeof(FrozenEntry), entries.size(), out) == entries.size());
+  for (size_t i = 0; written && i < sources.size(); i++) {
+    Cell *cell = sources[i].cell;
+    if (sources[i].key.size() > FROZEN_INLINE_SIZE)
+      written = fwrite(sources[i].key.data(), 1, sources[i].key.size(), out) == sources[i].key.size();
+    if (written && value_in_heap[i])
+      written = fwrite(cell->data(), 1, cell->size(), out) == cell->size();
+  }
+  if (written && !words.empty())
+    written = fwrite(words.data(), 1, words.size(), out) == words.size();
+  written = fflush(out) == 0 && written;
+#if !defined(_WIN32)
+  written = written && fsync(fileno(out)) == 0;
+#endif
+  if (fclose(out) != 0 || !written) {
+    string error = strerror(errno);
+    ::remove(path.c_str());
+    throw runtime_error("Can't write " + path + ": " + error);
+  }
+  flushed += header.file_size;
+}
+
+struct CloseWorker : public Nan::AsyncWorker {
+  SharedMap *map;
+  bool compact;
+  bool perfect;
+  CloseWorker(Nan::Callback *&callback, v8::Local<v8::Object> map, bool compact, bool perfect)
+    : AsyncWorker(callback), map(Nan::ObjectWrap::Unwrap<SharedMap>(map)), compact(compact),
+      perfect(perfect) {
+    SaveToPersistent(uint32_t(0), map);
+  }
+  virtual void Execute() { // May run in a separate thread
+    if (map->closed) {
+      SetErrorMessage("Attempted to close a closed object.");
+      return;                                
+    }
+    if (compact) {
+      // Write the frozen copy beside the file, then swap it in. On
+      // failure the object stays open and the file untouched.
+      string frozen_name = map->file_name + ".frozen";
+      try {
+        map->write_frozen(frozen_name, perfect);
+      } catch(runtime_error &ex) {
+        SetErrorMessage(ex.what());
+        return;
+      }
+      delete map->map_seg;
+      map->release_address_space();
+#if defined(_WIN32)
+      remove(map->file_name.c_str());
+#endif
+      if (rename(frozen_name.c_str(), map->file_name.c_str()) != 0)
+        SetErrorMessage(strerror(errno));
+    } else if (map->readonly) { // Nothing to write back.
+      if (map->mapping) { // Outstanding Buffers may still need the mapping.
+        map->mapping->release();
+        map->mapping = NULL;
+      } else {
+        delete map->map_seg;
+      }
+      delete map->frozen;
+      map->frozen = NULL;
+    } else {
+      {
+        FileLock guard(map, true);
+        map->sweep_interned();
+      }
+      if (map->live)
+        map->live->writer = 0;
+      // Others may still have a concurrent or live file mapped.
+      if (map->lock == NULL && map->live == NULL)
+        bip::managed_mapped_file::shrink_to_fit(map->file_name.c_str());
+      map->sync();
+      map->flushed += map->map_seg->get_size();
+      delete map->map_seg;
+      map->release_address_space();
+    }
+    map->closed = true; // Potentially racy
+    map->map_seg = NULL;
+    map->lock = NULL;
+    map->live = NULL;
+    delete map->compressor;
+    map->compressor = NULL;
+  }
+  // Back on the main thread the object is closed, or still open after a
+  // failed compaction, and writes go by that again.
+  virtual void HandleOKCallback() {
+    map->closing = false;
+    AsyncWorker::HandleOKCallback();
+  }
+  virtual void HandleErrorCallback() {
+    map->closing = false;
+    AsyncWorker::HandleErrorCallback();
+  }
+  friend class SharedMap;
+};
+
+// close([options], [callback]). With {compact: true}, rewrites the file
+// in the frozen layout as it closes; add perfectHash: true to index it
+// with a perfect hash.
+NAN_METHOD(SharedMap::Close) {
+  bool options = !info[0]->IsFunction();
+  bool compact = options && Nan::To<bool>(getOption(info[0], "compact")).FromJust();
+  bool perfect = options && Nan::To<bool>(getOption(info[0], "perfectHash")).FromJust();
+  close(info, compact, perfect, options ? info[1] : info[0]);
+}
+
+// freeze([options], [callback]), the same as close() with compact set.
+NAN_METHOD(SharedMap::freeze) {
+  bool options = !info[0]->IsFunction();
+  bool perfect = options && Nan::To<bool>(getOption(info[0], "perfectHash")).FromJust();
+  close(info, true, perfect, options ? info[1] : info[0]);
+}
+
+void SharedMap::close(const Nan::FunctionCallbackInfo<v8::Value> &info, bool compact,
+                      bool perfect, v8::Local<v8::Value> callback) {
+  auto self = Nan::ObjectWrap::Unwrap<SharedMap>(info.This());
+  if (compact && self->readonly) {
+    Nan::ThrowError("Only objects from Create can be compacted.");
+    return;
+  }
+  if (compact && self->lock) {
+    Nan::ThrowError("Concurrent objects can't be compacted.");
+    return;
+  }
+  if (compact && self->live) {
+    Nan::ThrowError("Live objects can't be compacted.");
+    return;
+  }
+  if (self->closing) {
+    Nan::ThrowError("Attempted to close an object that is already closing.");
+    return;
+  }
+
+  Nan::Callback *cb = NULL;
+  if (callback->IsFunction())
+    cb = new Nan::Callback(callback.As<v8::Function>());
+
+  auto closer = new CloseWorker(cb, info.This(), compact, perfect);
+
+  if (callback->IsFunction()) { // Close asynchronously
+    // The worker reads, and may free, the table, so writes throw until
+    // it is done.
+    self->closing = true;
+    AsyncQueueWorker(closer);
+    return;
+  }
+
+  // Close synchronously
+  closer->Execute();
+  auto msg = closer->ErrorMessage();
+  if (msg != NULL)
+    Nan::ThrowError(msg);
+}
+
+// Flushes through a mapping of its own rather than the object's, so the
+// object can go on writing, growing and remapping the file while a flush
+// runs in the background. Dirty pages belong to the file, so syncing any
+// mapping of it writes back the ones the object's mapping dirtied.
+struct FlushWorker : public Nan::AsyncWorker {
+  SharedMap *map;
+  bip::mapped_region *region;
+  FlushWorker(Nan::Callback *&callback, v8::Local<v8::Object> map)
+    : AsyncWorker(callback), map(Nan::ObjectWrap::Unwrap<SharedMap>(map)), region(NULL) {
+    SaveToPersistent(uint32_t(0), map);
+    if (this->map->closed) {
+      SetErrorMessage("Attempted to flush a closed object.");
+      return;
+    }
+    if (this->map->readonly) // Nothing to write back.
+      return;
+    try {
+      bip::file_mapping file(this->map->file_name.c_str(), bip::read_write);
+      region = new bip::mapped_region(file, bip::read_write, 0, this->map->map_seg->get_size());
+    } catch(bip::interprocess_exception &ex) {
+      SetErrorMessage(ex.what());
+    }
+  }
+  ~FlushWorker() { delete region; }
+  virtual void Execute() { // May run in a separate thread
+    if (region && !region->flush(0, 0, false))
+      SetErrorMessage("Can't flush the file.");
+  }
+  virtual void HandleOKCallback() {
+    count_flushed();
+    AsyncWorker::HandleOKCallback();
+  }
+  void count_flushed() {
+    if (region)
+      map->flushed += region->get_size();
+  }
+  friend class SharedMap;
+};
+
+NAN_METHOD(SharedMap::Flush) {
+  Nan::Callback *cb = NULL;
+  if (info[0]->IsFunction())
+    cb = new Nan::Callback(info[0].As<v8::Function>());
+
+  auto flusher = new FlushWorker(cb, info.This());
+
+  if (info[0]->IsFunction()) { // Flush asynchronously
+    AsyncQueueWorker(flusher);
+    return;
+  }
+
+  // Flush synchronously
+  flusher->Execute();
+  auto msg = flusher->ErrorMessage();
+  if (msg != NULL)
+    Nan::ThrowError(msg);
+  else
+    flusher->count_flushed();
+  delete flusher;
+}
+
+NAN_METHOD(SharedMap::isClosed) {
+  auto self = Nan::ObjectWrap::Unwrap<SharedMap>(info.This());
+  info.GetReturnValue().Set(self->closed);
+}
+
+NAN_METHOD(SharedMap::isOpen) {
+  auto self = Nan::ObjectWrap::Unwrap<SharedMap>(info.This());
+  info.GetReturnValue().Set(!self->closed);
+}
+
+NAN_METHOD(SharedMap::isData) {
+  auto value = info[0];
+  if (value->IsFunction()) {
+    bool success = Nan::GetRealNamedProperty(value->ToObject(),
+                                             Nan::New("name").ToLocalChecked()
+                                             ).ToLocal(&value);
+    if (!success) {
+      value = info[0];
+    }
+  }
+  bool result = true;
+  if (value->IsString()) {
+    Nan::Utf8String name(value->ToString());
+    result = !isMethod(boost::string_ref(*name, name.length()));
+  }
+  info.GetReturnValue().Set(result);
+}
+
+v8::Local<v8::Function> SharedMap::init_methods(v8::Local<v8::FunctionTemplate> f_tpl) {
+#define SET_METHOD(name, method) Nan::SetPrototypeMethod(f_tpl, name, method);
+  SHARED_MAP_METHODS(SET_METHOD)
+#undef SET_METHOD
+
+  auto proto = f_tpl->PrototypeTemplate();
+  Nan::SetNamedPropertyHandler(proto, PropGetter, PropSetter, PropQuery, PropDeleter, PropEnumerator,
+                               Nan::True());
+
+  auto inst = f_tpl->InstanceTemplate();
+  inst->SetInternalFieldCount(1);
+  Nan::SetNamedPropertyHandler(inst, PropGetter, PropSetter, PropQuery, PropDeleter, PropEnumerator,
+                               Nan::False());
+  Nan::SetIndexedPropertyHandler(inst, IndexGetter, IndexSetter, IndexQuery, IndexDeleter, IndexEnumerator,
+                                 Nan::False());
+  auto fun = Nan::GetFunction(f_tpl).ToLocalChecked();
+  constructor().Reset(fun);
+  return fun;
+}
+
+// Which of shards files a key lives in. This multiplies by a different
+// constant than mixHash() so that each shard's keys still spread over
+// the whole of its own table and frozen directory.
+inline uint32_t shardIndex(size_t hash, uint32_t shards) {
+  return (uint32_t)(((uint64_t)hash * 0xc2b2ae3d27d4eb4full >> 32) * shards >> 32);
+}
+
+// Methods on the prototype of CreateSharded and OpenSharded objects.
+// Every name is also in SHARED_MAP_METHODS, so isMethod() covers them.
+#define SHARDED_MAP_METHODS(X)                  \
+  X("close", Close)                             \
+  X("flush", Flush)                             \
+  X("isClosed", isClosed)                       \
+  X("isOpen", isOpen)                           \
+  X("isData", isData)                           \
+  X("get_free_memory", get_free_memory)         \
+  X("get_size", get_size)                       \
+  X("setMany", setMany)                         \
+  X("getMany", getMany)
+
+// A directory of ordinary Create files, each holding the keys whose
+// hash routes to it. Shards share no segment or lock, so separate
+// processes can load one each (see the shard option) and readers go
+// straight to the only file a key can be in.
+class ShardedMap : public Nan::ObjectWrap {
+  ShardedMap(uint32_t count, bool readonly) : shards(count), readonly(readonly),
+                                              closed(false) {}
+  ~ShardedMap() { objects.Reset(); }
+
+public:
+  static void Init(v8::Local<v8::Object> target, v8::Local<v8::Function> create,
+                   v8::Local<v8::Function> open);
+
+private:
+  vector<SharedMap *> shards; // NULL for shards this object didn't open.
+  Nan::Persistent<v8::Array> objects; // The shards' own objects.
+  bool readonly;
+  bool closed;
+  bool writable(uint32_t shard);
+  Nan::MaybeLocal<v8::Value> call(uint32_t shard, const char *method, int argc,
+                                  v8::Local<v8::Value> argv[]);
+  template <typename Each> bool each_shard(const char *method, int argc,
+                                           v8::Local<v8::Value> argv[], Each each);
+  static void open_shards(const Nan::FunctionCallbackInfo<v8::Value> &info, const string &dir,
+                          uint32_t count, v8::Local<v8::Function> opener,
+                          vector<v8::Local<v8::Value>> argv, bool readonly);
+  static v8::Local<v8::Function> gather(uint32_t count, v8::Local<v8::Value> callback);
+  static v8::Local<v8::Function> init_methods(v8::Local<v8::FunctionTemplate> f_tpl);
+  static NAN_METHOD(CreateSharded);
+  static NAN_METHOD(OpenSharded);
+  static NAN_METHOD(shardOf);
+  static NAN_METHOD(shardDone);
+#define DECLARE_METHOD(name, method) static NAN_METHOD(method);
+  SHARDED_MAP_METHODS(DECLARE_METHOD)
+#undef DECLARE_METHOD
+  static NAN_PROPERTY_SETTER(PropSetter);
+  static NAN_PROPERTY_GETTER(PropGetter);
+  static NAN_PROPERTY_QUERY(PropQuery);
+  static NAN_PROPERTY_ENUMERATOR(PropEnumerator);
+  static NAN_PROPERTY_DELETER(PropDeleter);
+  static NAN_INDEX_GETTER(IndexGetter);
+  static NAN_INDEX_SETTER(IndexSetter);
+  static NAN_INDEX_QUERY(IndexQuery);
+  static NAN_INDEX_DELETER(IndexDeleter);
+  static NAN_INDEX_ENUMERATOR(IndexEnumerator);
+  static inline Nan::Persistent<v8::Function> & opener(bool create) {
+    static Nan::Persistent<v8::Function> create_constructor, open_constructor;
+    return create ? create_constructor : open_constructor;
+  }
+};
+
+string shardFile(const string &dir, uint32_t shard) {
+  ostringstream name;
+  name << dir << "/shard-" << shard;
+  return name.str();
+}
+
+// The shard count in a set's manifest, or 0 if it has none.
+uint32_t readShardCount(const string &dir) {
+  FILE *in = fopen((dir + "/shards").c_str(), "r");
+  if (in == NULL)
+    return 0;
+  unsigned count = 0;
+  if (fscanf(in, "%u", &count) != 1)
+    count = 0;
+  fclose(in);
+  return count;
+}
+
+// Whether this object opened the shard a key goes to. Throws if not.
+bool ShardedMap::writable(uint32_t shard) {
+  if (shards[shard])
+    return true;
+  ostringstream error_stream;
+  error_stream << "That key belongs to shard " << shard << ", which this object didn't open.";
+  Nan::ThrowError(error_stream.str().c_str());
+  return false;
+}
+
+// Calls a method on a shard's own object.
+Nan::MaybeLocal<v8::Value> ShardedMap::call(uint32_t shard, const char *method, int argc,
+                                            v8::Local<v8::Value> argv[]) {
+  auto object = Nan::Get(Nan::New(objects), shard).ToLocalChecked().As<v8::Object>();
+  auto fn = Nan::Get(object, Nan::New(method).ToLocalChecked()).ToLocalChecked();
+  return Nan::Call(fn.As<v8::Function>(), object, argc, argv);
+}
+
+// Calls a method on every shard this object opened, handing each result
+// to each. Returns false once one has thrown.
+template <typename Each>
+bool ShardedMap::each_shard(const char *method, int argc, v8::Local<v8::Value> argv[], Each each) {
+  for (uint32_t i = 0; i < shards.size(); i++) {
+    v8::Local<v8::Value> result;
+    if (shards[i] == NULL)
+      continue;
+    if (!call(i, method, argc, argv).ToLocal(&result))
+      return false;
+    each(result);
+  }
+  return true;
+}
+
+// A callback for count shards to share. Once the last has called it,
+// calls callback with the first error any of them had.
+v8::Local<v8::Function> ShardedMap::gather(uint32_t count, v8::Local<v8::Value> callback) {
+  auto state = Nan::New<v8::Array>(3);
+  Nan::Set(state, 0, Nan::New(count));
+  Nan::Set(state, 1, callback);
+  Nan::Set(state, 2, Nan::Undefined());
+  return Nan::GetFunction(Nan::New<v8::FunctionTemplate>(shardDone, state)).ToLocalChecked();
+}
+
+NAN_METHOD(ShardedMap::shardDone) {
+  auto state = info.Data().As<v8::Array>();
+  uint32_t left = Nan::To<uint32_t>(Nan::Get(state, 0).ToLocalChecked()).FromJust() - 1;
+  Nan::Set(state, 0, Nan::New(left));
+  if (!info[0]->IsUndefined() && !info[0]->IsNull() &&
+      Nan::Get(state, 2).ToLocalChecked()->IsUndefined())
+    Nan::Set(state, 2, info[0]);
+  if (left > 0)
     return;
+  v8::Local<v8::Value> argv[] = {Nan::Get(state, 2).ToLocalChecked()};
+  auto callback = Nan::Get(state, 1).ToLocalChecked().As<v8::Function>();
+  Nan::Call(callback, Nan::GetCurrentContext()->Global(), argv[0]->IsUndefined() ? 0 : 1, argv);
+}
+
+// Opens each shard in dir with opener, Create or Open, passing argv on
+// after the shard's file name. The shard option opens just that one.
+void ShardedMap::open_shards(const Nan::FunctionCallbackInfo<v8::Value> &info, const string &dir,
+                             uint32_t count, v8::Local<v8::Function> opener,
+                             vector<v8::Local<v8::Value>> argv, bool readonly) {
+  uint32_t first = 0, last = count;
+  auto shard_option = getOption(argv.back(), "shard");
+  if (!shard_option->IsUndefined()) {
+    double shard = Nan::To<double>(shard_option).FromJust();
+    if (!(shard >= 0) || shard >= count || shard != floor(shard)) {
+      ostringstream error_stream;
+      error_stream << "shard must be a shard number below " << count << ".";
+      Nan::ThrowError(error_stream.str().c_str());
+      return;
+    }
+    first = (uint32_t)shard;
+    last = first + 1;
   }
-  
-  v8::String::Utf8Value src(property);
 
-  if (isMethod(string(*src))) {
-    info.GetReturnValue().Set(Nan::New<v8::Boolean>(v8::None));
+  auto d = new ShardedMap(count, readonly);
+  auto objects = Nan::New<v8::Array>(count);
+  d->objects.Reset(objects);
+  Nan::TryCatch failure;
+  for (uint32_t i = first; i < last; i++) {
+    argv[0] = Nan::New(shardFile(dir, i)).ToLocalChecked();
+    v8::Local<v8::Object> shard;
+    if (!Nan::NewInstance(opener, argv.size(), argv.data()).ToLocal(&shard)) {
+      // Let go of the shards opened so far before passing the error on.
+      d->each_shard("close", 0, NULL, [](v8::Local<v8::Value>) {});
+      delete d;
+      failure.ReThrow();
+      return;
+    }
+    Nan::Set(objects, i, shard);
+    d->shards[i] = Nan::ObjectWrap::Unwrap<SharedMap>(shard);
+  }
+  d->Wrap(info.This());
+  info.GetReturnValue().Set(info.This());
+}
+
+// new CreateSharded(dir, shards, [file_size], [initial_bucket_count],
+// [max_file_size], [options]). The sizes and options are per shard.
+NAN_METHOD(ShardedMap::CreateSharded) {
+  if (!info.IsConstructCall()) {
+    Nan::ThrowError("CreateSharded must be called as a constructor.");
     return;
   }
-  
-  auto self = Nan::ObjectWrap::Unwrap<SharedMap>(info.This());
 
-  if (self->readonly) {
-    Nan::ThrowError("Cannot delete from read-only object.");
+  Nan::Utf8String dir(info[0]->ToString());
+  double count = Nan::To<double>(info[1]).FromJust();
+  if (!(count >= 1) || count > MAX_SHARDS || count != floor(count)) {
+    ostringstream error_stream;
+    error_stream << "CreateSharded needs a number of shards from 1 to " << MAX_SHARDS << ".";
+    Nan::ThrowError(error_stream.str().c_str());
     return;
   }
 
-  if (self->closed) {
-    Nan::ThrowError("Cannot delete from closed object.");
+  // Loaders of the same set may race to set it up. They all write the
+  // same manifest, so the race is harmless.
+#if defined(_WIN32)
+  _mkdir(*dir);
+#else
+  mkdir(*dir, 0777);
+#endif
+  uint32_t existing = readShardCount(*dir);
+  if (existing == 0) {
+    string manifest = string(*dir) + "/shards";
+    FILE *out = fopen(manifest.c_str(), "w");
+    bool written = out != NULL && fprintf(out, "%u\n", (unsigned)count) > 0;
+    written = (out == NULL || fclose(out) == 0) && written;
+    if (!written) {
+      ostringstream error_stream;
+      error_stream << "Can't write " << manifest << ": " << strerror(errno);
+      Nan::ThrowError(error_stream.str().c_str());
+      return;
+    }
+  } else if (existing != count) {
+    ostringstream error_stream;
+    error_stream << *dir << " already holds " << existing << " shards.";
+    Nan::ThrowError(error_stream.str().c_str());
     return;
   }
 
-  v8::String::Utf8Value prop(property);
-  shared_string *string_key;
-  char_allocator allocer(self->map_seg->get_segment_manager());
-  string_key = new shared_string(string(*prop).c_str(), allocer);
-  self->property_map->erase(*string_key);
+  vector<v8::Local<v8::Value>> argv = {Nan::Undefined(), info[2], info[3], info[4], info[5]};
+  open_shards(info, *dir, (uint32_t)count, Nan::New(opener(true)), argv, false);
 }
 
-NAN_PROPERTY_ENUMERATOR(SharedMap::PropEnumerator) {
-  v8::Local<v8::Array> arr = Nan::New<v8::Array>();
-  auto self = Nan::ObjectWrap::Unwrap<SharedMap>(info.This());
-
-  if (self->closed) {
-    info.GetReturnValue().Set(Nan::New<v8::Array>(v8::None));
+// new OpenSharded(dir, [options]). The options are per shard.
+NAN_METHOD(ShardedMap::OpenSharded) {
+  if (!info.IsConstructCall()) {
+    Nan::ThrowError("OpenSharded must be called as a constructor.");
     return;
   }
 
-  int i = 0;
-  for (auto it = self->property_map->begin(); it != self->property_map->end(); ++it) {
-	  arr->Set(i++, Nan::New<v8::String>(it->first.c_str()).ToLocalChecked());
+  Nan::Utf8String dir(info[0]->ToString());
+  uint32_t count = readShardCount(*dir);
+  if (count == 0 || count > MAX_SHARDS) {
+    ostringstream error_stream;
+    error_stream << *dir << " is not a sharded set.";
+    Nan::ThrowError(error_stream.str().c_str());
+    return;
   }
-  info.GetReturnValue().Set(arr);
-}
 
-#define INFO_METHOD(name, type, object) NAN_METHOD(SharedMap::name) { \
-  auto self = Nan::ObjectWrap::Unwrap<SharedMap>(info.This()); \
-  info.GetReturnValue().Set((type)self->object->name()); \
+  vector<v8::Local<v8::Value>> argv = {Nan::Undefined(), info[1]};
+  open_shards(info, *dir, count, Nan::New(opener(false)), argv, true);
 }
 
-INFO_METHOD(get_free_memory, uint32_t, map_seg)
-INFO_METHOD(get_size, uint32_t, map_seg)
-INFO_METHOD(bucket_count, uint32_t, property_map)
-INFO_METHOD(max_bucket_count, uint32_t, property_map)
-INFO_METHOD(load_factor, float, property_map)
-INFO_METHOD(max_load_factor, float, property_map)
+// shardOf(key, shards), the shard of a set of shards that holds key, so
+// a loader can pick out the keys that are its own.
+NAN_METHOD(ShardedMap::shardOf) {
+  double count = Nan::To<double>(info[1]).FromJust();
+  if (info[0]->IsSymbol() || !(count >= 1) || count > MAX_SHARDS || count != floor(count)) {
+    Nan::ThrowError("shardOf needs a key and a number of shards.");
+    return;
+  }
+  Nan::Utf8String key(info[0]);
+  info.GetReturnValue().Set(shardIndex(hasher()(boost::string_ref(*key, key.length())),
+                                       (uint32_t)count));
+}
 
-NAN_METHOD(SharedMap::Create) {
-  if (!info.IsConstructCall()) {
-    Nan::ThrowError("Create must be called as a constructor.");
+NAN_PROPERTY_GETTER(ShardedMap::PropGetter) {
+  if (property->IsSymbol()) {
     return;
   }
 
-  Nan::Utf8String filename(info[0]->ToString());
-  size_t file_size = (int)info[1]->Int32Value();
-  file_size *= 1024;
-  size_t initial_bucket_count = (int)info[2]->Int32Value();
-  size_t max_file_size = (int)info[3]->Int32Value();
-  max_file_size *= 1024;
+  Nan::Utf8String src(property);
+  boost::string_ref key(*src, src.length());
 
-  if (file_size == 0) {
-    file_size = DEFAULT_FILE_SIZE;
-  }
-  // Don't open it too small.
-  if (file_size < MINIMUM_FILE_SIZE) {
-    file_size = 500;
-    max_file_size = max(file_size, max_file_size);
-  }
-  if (max_file_size == 0) {
-    max_file_size = DEFAULT_MAX_SIZE;
+  if (key == "inspect") {
+    info.GetReturnValue().Set(SharedMap::inspector());
+    return;
   }
 
-  // Default to 1024 buckets
-  if (initial_bucket_count == 0) {
-    initial_bucket_count = 1024;
+  if (isMethod(key)) {
+    return;
   }
-  SharedMap *d = new SharedMap(*filename, file_size, max_file_size);
 
-  try {
-    d->map_seg = new bip::managed_mapped_file(bip::open_or_create,string(*filename).c_str(), file_size);
-    d->property_map = d->map_seg->find_or_construct<PropertyHash>("properties")
-      (initial_bucket_count, hasher(), s_equal_to(), d->map_seg->get_segment_manager());
-    d->closed = false;
-  } catch(bip::interprocess_exception &ex){
-    ostringstream error_stream;
-    error_stream << "Can't open file " << *filename << ": " << ex.what();
-    Nan::ThrowError(error_stream.str().c_str());
+  auto self = Nan::ObjectWrap::Unwrap<ShardedMap>(info.This());
+  if (self->closed) {
+    Nan::ThrowError("Cannot read from closed object.");
     return;
   }
-  d->Wrap(info.This());
-  info.GetReturnValue().Set(info.This());
+
+  // Keys of shards this object didn't open read as missing.
+  size_t hash = hasher()(key);
+  auto shard = self->shards[shardIndex(hash, self->shards.size())];
+  if (shard)
+    shard->get(key, hash, info.GetReturnValue());
 }
 
-NAN_METHOD(SharedMap::Open) {
-  if (!info.IsConstructCall()) {
-    Nan::ThrowError("Open must be called as a constructor.");
+NAN_PROPERTY_SETTER(ShardedMap::PropSetter) {
+  if (property->IsSymbol()) {
+    Nan::ThrowError("Symbol properties are not supported.");
     return;
   }
 
-  Nan::Utf8String filename(info[0]->ToString());
+  auto self = Nan::ObjectWrap::Unwrap<ShardedMap>(info.This());
+  Nan::Utf8String prop(property);
+  boost::string_ref key(*prop, prop.length());
+  uint32_t shard = shardIndex(hasher()(key), self->shards.size());
+  if (self->writable(shard) && self->shards[shard]->put(key, value))
+    info.GetReturnValue().Set(value);
+}
 
-  struct stat buf;
-  int s = stat(*filename, &buf);
-  if (s == -1 || !S_ISREG(buf.st_mode) || buf.st_size == 0) {
-    ostringstream error_stream;
-    error_stream << *filename;
-    if (s == -1) {
-      error_stream << ": " << strerror(errno);
-    } else if (!S_ISREG(buf.st_mode)) {
-      error_stream << " is not a regular file.";
-    } else {
-      error_stream << " is an empty file.";
-    }
-    Nan::ThrowError(error_stream.str().c_str());
+NAN_PROPERTY_QUERY(ShardedMap::PropQuery) {
+  Nan::Utf8String src(property);
+
+  if (isMethod(boost::string_ref(*src, src.length()))) {
+    info.GetReturnValue().Set(Nan::New<v8::Integer>(v8::ReadOnly | v8::DontEnum | v8::DontDelete));
     return;
   }
-  SharedMap *d = new SharedMap(*filename);
+  auto self = Nan::ObjectWrap::Unwrap<ShardedMap>(info.This());
 
-  try {
-    d->map_seg = new bip::managed_mapped_file(bip::open_read_only, string(*filename).c_str());
-    if (d->map_seg->get_size() != (unsigned long)buf.st_size) {
-      ostringstream error_stream;
-      error_stream << "File " << *filename << " appears to be corrupt (1).";
-      Nan::ThrowError(error_stream.str().c_str());
-      return;
-    }
-    auto find_map = d->map_seg->find<PropertyHash>("properties");
-    d->property_map = find_map.first;
-    if (d->property_map == NULL) {
-      ostringstream error_stream;
-      error_stream << "File " << *filename << " appears to be corrupt (2).";
-      Nan::ThrowError(error_stream.str().c_str());
-      return;
-    }
-  } catch(bip::interprocess_exception &ex){
-    ostringstream error_stream;
-    error_stream << "Can't open file " << *filename << ": " << ex.what();
-    Nan::ThrowError(error_stream.str().c_str());
+  if (self->readonly) {
+    info.GetReturnValue().Set(Nan::New<v8::Integer>(v8::ReadOnly | v8::DontDelete));
     return;
   }
-  d->readonly = true;
-  d->closed = false;
-  d->Wrap(info.This());
-  info.GetReturnValue().Set(info.This());
+
+  info.GetReturnValue().Set(Nan::New<v8::Integer>(v8::None));
 }
 
-void SharedMap::grow(size_t size) {
-  file_size += size;
-  if (file_size > max_file_size) {
-    throw FileTooLarge();
+NAN_PROPERTY_DELETER(ShardedMap::PropDeleter) {
+  if (property->IsSymbol()) {
+    Nan::ThrowError("Symbol properties are not supported for delete.");
+    return;
   }
-  map_seg->flush();
-  delete map_seg;
-  bip::managed_mapped_file::grow(file_name.c_str(), size);
-  map_seg = new bip::managed_mapped_file(bip::open_only, file_name.c_str());
-  property_map = map_seg->find<PropertyHash>("properties").first;
-  closed = false;
-}
 
-struct CloseWorker : public Nan::AsyncWorker {
-  SharedMap *map;
-  CloseWorker(Nan::Callback *&callback, v8::Local<v8::Object> map)
-    : AsyncWorker(callback), map(Nan::ObjectWrap::Unwrap<SharedMap>(map)) {
-    SaveToPersistent(uint32_t(0), map);
+  Nan::Utf8String src(property);
+  boost::string_ref key(*src, src.length());
+
+  if (isMethod(key)) {
+    info.GetReturnValue().Set(Nan::New<v8::Boolean>(v8::None));
+    return;
   }
-  virtual void Execute() { // May run in a separate thread
-    if (map->closed) {
-      SetErrorMessage("Attempted to close a closed object.");
-      return;                                
-    }
-    bip::managed_mapped_file::shrink_to_fit(map->file_name.c_str());
-    map->map_seg->flush();
-    delete map->map_seg;
-    map->closed = true; // Potentially racy
-    map->map_seg = NULL;
+
+  auto self = Nan::ObjectWrap::Unwrap<ShardedMap>(info.This());
+  uint32_t shard = shardIndex(hasher()(key), self->shards.size());
+  if (self->writable(shard))
+    self->shards[shard]->remove_key(key);
+}
+
+NAN_PROPERTY_ENUMERATOR(ShardedMap::PropEnumerator) {
+  v8::Local<v8::Array> arr = Nan::New<v8::Array>();
+  auto self = Nan::ObjectWrap::Unwrap<ShardedMap>(info.This());
+  for (size_t i = 0; i < self->shards.size(); i++) {
+    if (self->shards[i] && !self->shards[i]->append_keys(arr))
+      return;
   }
-  friend class SharedMap;
-};
+  info.GetReturnValue().Set(arr);
+}
 
-NAN_METHOD(SharedMap::Close) {
-  Nan::Callback *cb = NULL;
-  if (info[0]->IsFunction())
-    cb = new Nan::Callback(info[0].As<v8::Function>());
+NAN_INDEX_GETTER(ShardedMap::IndexGetter) {
+  STRINGINDEX;
+  ShardedMap::PropGetter(prop, info);
+}
 
-  auto closer = new CloseWorker(cb, info.This());
+NAN_INDEX_SETTER(ShardedMap::IndexSetter) {
+  STRINGINDEX;
+  ShardedMap::PropSetter(prop, value, info);
+}
 
-  if (info[0]->IsFunction()) { // Close asynchronously
-    AsyncQueueWorker(closer);
-    return;
-  }
+NAN_INDEX_QUERY(ShardedMap::IndexQuery) {
+  STRINGINDEX;
+  ShardedMap::PropQuery(prop, info);
+}
 
-  // Close synchronously
-  closer->Execute();
-  auto msg = closer->ErrorMessage();
-  if (msg != NULL)
-    Nan::ThrowError(msg);
+NAN_INDEX_DELETER(ShardedMap::IndexDeleter) {
+  STRINGINDEX;
+  ShardedMap::PropDeleter(prop, info);
 }
 
-NAN_METHOD(SharedMap::isClosed) {
-  auto self = Nan::ObjectWrap::Unwrap<SharedMap>(info.This());
+NAN_INDEX_ENUMERATOR(ShardedMap::IndexEnumerator) {
+  info.GetReturnValue().Set(Nan::New<v8::Array>(v8::None));
+}
+
+// close([options], [callback]) closes every shard, passing the options
+// on. With a callback the shards close side by side.
+NAN_METHOD(ShardedMap::Close) {
+  auto self = Nan::ObjectWrap::Unwrap<ShardedMap>(info.This());
+  bool options = !info[0]->IsFunction();
+  auto callback = options ? info[1] : info[0];
+  uint32_t open = 0;
+  for (size_t i = 0; i < self->shards.size(); i++)
+    open += self->shards[i] != NULL;
+  v8::Local<v8::Value> argv[] = {Nan::Undefined(), Nan::Undefined()};
+  if (options)
+    argv[0] = info[0];
+  if (callback->IsFunction())
+    argv[1] = gather(open, callback);
+  if (self->each_shard("close", callback->IsFunction() ? 2 : 1, argv, [](v8::Local<v8::Value>) {}))
+    self->closed = true;
+}
+
+// flush([callback]) flushes every shard.
+NAN_METHOD(ShardedMap::Flush) {
+  auto self = Nan::ObjectWrap::Unwrap<ShardedMap>(info.This());
+  uint32_t open = 0;
+  for (size_t i = 0; i < self->shards.size(); i++)
+    open += self->shards[i] != NULL;
+  v8::Local<v8::Value> argv[] = {Nan::Undefined()};
+  if (info[0]->IsFunction())
+    argv[0] = gather(open, info[0]);
+  self->each_shard("flush", info[0]->IsFunction() ? 1 : 0, argv, [](v8::Local<v8::Value>) {});
+}
+
+NAN_METHOD(ShardedMap::isClosed) {
+  auto self = Nan::ObjectWrap::Unwrap<ShardedMap>(info.This());
   info.GetReturnValue().Set(self->closed);
 }
 
-NAN_METHOD(SharedMap::isOpen) {
-  auto self = Nan::ObjectWrap::Unwrap<SharedMap>(info.This());
+NAN_METHOD(ShardedMap::isOpen) {
+  auto self = Nan::ObjectWrap::Unwrap<ShardedMap>(info.This());
   info.GetReturnValue().Set(!self->closed);
 }
 
-NAN_METHOD(SharedMap::isData) {
-  auto value = info[0];
-  if (value->IsFunction()) {
-    bool success = Nan::GetRealNamedProperty(value->ToObject(),
-                                             Nan::New("name").ToLocalChecked()
-                                             ).ToLocal(&value);
-    if (!success) {
-      value = info[0];
-    }
+NAN_METHOD(ShardedMap::isData) {
+  SharedMap::isData(info);
+}
+
+// Sums a size over the shards this object opened.
+#define SHARD_TOTAL_METHOD(name) NAN_METHOD(ShardedMap::name) {     \
+  auto self = Nan::ObjectWrap::Unwrap<ShardedMap>(info.This());      \
+  double total = 0;                                                   \
+  if (self->each_shard(#name, 0, NULL, [&](v8::Local<v8::Value> size) { \
+        total += Nan::To<double>(size).FromJust();                    \
+      }))                                                             \
+    info.GetReturnValue().Set(total);                                 \
+}
+
+SHARD_TOTAL_METHOD(get_free_memory)
+SHARD_TOTAL_METHOD(get_size)
+
+// Splits the keys by shard and hands each shard its share as one batch,
+// so its getMany() still probes them back to back.
+NAN_METHOD(ShardedMap::getMany) {
+  auto self = Nan::ObjectWrap::Unwrap<ShardedMap>(info.This());
+  if (!info[0]->IsArray()) {
+    Nan::ThrowError("getMany needs an array of keys.");
+    return;
   }
-  bool result = true;
-  if (value->IsString()) {
-    result = !isMethod(*Nan::Utf8String(value->ToString()));
+
+  if (self->closed) {
+    Nan::ThrowError("Cannot read from closed object.");
+    return;
   }
-  info.GetReturnValue().Set(result);
+
+  auto list = info[0].As<v8::Array>();
+  uint32_t length = list->Length();
+  auto results = Nan::New<v8::Array>(length);
+  vector<v8::Local<v8::Array>> batches(self->shards.size());
+  vector<vector<uint32_t>> positions(self->shards.size());
+  for (uint32_t i = 0; i < length; i++) {
+    Nan::Set(results, i, Nan::Undefined());
+    auto key = Nan::Get(list, i).ToLocalChecked();
+    if (key->IsSymbol())
+      continue;
+    Nan::Utf8String decoded(key);
+    uint32_t shard = shardIndex(hasher()(boost::string_ref(*decoded, decoded.length())),
+                                self->shards.size());
+    if (self->shards[shard] == NULL)
+      continue;
+    if (positions[shard].empty())
+      batches[shard] = Nan::New<v8::Array>();
+    Nan::Set(batches[shard], positions[shard].size(), key);
+    positions[shard].push_back(i);
+  }
+
+  for (uint32_t shard = 0; shard < self->shards.size(); shard++) {
+    if (positions[shard].empty())
+      continue;
+    v8::Local<v8::Value> argv[] = {batches[shard]};
+    v8::Local<v8::Value> values;
+    if (!self->call(shard, "getMany", 1, argv).ToLocal(&values))
+      return;
+    for (uint32_t j = 0; j < positions[shard].size(); j++)
+      Nan::Set(results, positions[shard][j], Nan::Get(values.As<v8::Array>(), j).ToLocalChecked());
+  }
+  info.GetReturnValue().Set(results);
 }
 
-v8::Local<v8::Function> SharedMap::init_methods(v8::Local<v8::FunctionTemplate> f_tpl) {
-  Nan::SetPrototypeMethod(f_tpl, "close", Close);
-  Nan::SetPrototypeMethod(f_tpl, "isClosed", isClosed);
-  Nan::SetPrototypeMethod(f_tpl, "isOpen", isOpen);
-  Nan::SetPrototypeMethod(f_tpl, "isData", isData);
-  Nan::SetPrototypeMethod(f_tpl, "get_free_memory", get_free_memory);
-  Nan::SetPrototypeMethod(f_tpl, "get_size", get_size);
-  Nan::SetPrototypeMethod(f_tpl, "bucket_count", bucket_count);
-  Nan::SetPrototypeMethod(f_tpl, "max_bucket_count", max_bucket_count);
-  Nan::SetPrototypeMethod(f_tpl, "load_factor", load_factor);
-  Nan::SetPrototypeMethod(f_tpl, "max_load_factor", max_load_factor);
+// Routes every pair before writing any, then hands each shard its share
+// as one setMany() batch.
+NAN_METHOD(ShardedMap::setMany) {
+  auto self = Nan::ObjectWrap::Unwrap<ShardedMap>(info.This());
+  if (self->readonly) {
+    Nan::ThrowError("Read-only object.");
+    return;
+  }
 
-  auto proto = f_tpl->PrototypeTemplate();
-  Nan::SetNamedPropertyHandler(proto, PropGetter, PropSetter, PropQuery, PropDeleter, PropEnumerator,
-                               Nan::New<v8::String>("prototype").ToLocalChecked());
+  if (self->closed) {
+    Nan::ThrowError("Cannot write to closed object.");
+    return;
+  }
+
+  vector<v8::Local<v8::Value>> keys, values;
+  if (!gatherPairs(info[0], keys, values))
+    return;
+
+  // Check every pair before any shard writes its batch.
+  vector<v8::Local<v8::Array>> batches(self->shards.size());
+  vector<uint32_t> sizes(self->shards.size());
+  for (size_t i = 0; i < keys.size(); i++) {
+    if (!checkValue(values[i]))
+      return;
+    Nan::Utf8String key(keys[i]);
+    uint32_t shard = shardIndex(hasher()(boost::string_ref(*key, key.length())),
+                                self->shards.size());
+    if (!self->writable(shard))
+      return;
+    if (sizes[shard] == 0)
+      batches[shard] = Nan::New<v8::Array>();
+    auto pair = Nan::New<v8::Array>(2);
+    Nan::Set(pair, 0, keys[i]);
+    Nan::Set(pair, 1, values[i]);
+    Nan::Set(batches[shard], sizes[shard]++, pair);
+  }
+
+  for (uint32_t shard = 0; shard < self->shards.size(); shard++) {
+    v8::Local<v8::Value> argv[] = {batches[shard]};
+    if (sizes[shard] > 0 && self->call(shard, "setMany", 1, argv).IsEmpty())
+      return;
+  }
+}
+
+v8::Local<v8::Function> ShardedMap::init_methods(v8::Local<v8::FunctionTemplate> f_tpl) {
+#define SET_METHOD(name, method) Nan::SetPrototypeMethod(f_tpl, name, method);
+  SHARDED_MAP_METHODS(SET_METHOD)
+#undef SET_METHOD
 
   auto inst = f_tpl->InstanceTemplate();
   inst->SetInternalFieldCount(1);
-  Nan::SetNamedPropertyHandler(inst, PropGetter, PropSetter, PropQuery, PropDeleter, PropEnumerator,
-                               Nan::New<v8::String>("instance").ToLocalChecked());
-  Nan::SetIndexedPropertyHandler(inst, IndexGetter, IndexSetter, IndexQuery, IndexDeleter, IndexEnumerator,
-                                 Nan::New<v8::String>("instance").ToLocalChecked());
-  auto fun = Nan::GetFunction(f_tpl).ToLocalChecked();
-  constructor().Reset(fun);
-  return fun;
+  Nan::SetNamedPropertyHandler(inst, PropGetter, PropSetter, PropQuery, PropDeleter, PropEnumerator);
+  Nan::SetIndexedPropertyHandler(inst, IndexGetter, IndexSetter, IndexQuery, IndexDeleter,
+                                 IndexEnumerator);
+  return Nan::GetFunction(f_tpl).ToLocalChecked();
+}
+
+void ShardedMap::Init(v8::Local<v8::Object> target, v8::Local<v8::Function> create,
+                      v8::Local<v8::Function> open) {
+  opener(true).Reset(create);
+  opener(false).Reset(open);
+
+  v8::Local<v8::FunctionTemplate> create_tpl = Nan::New<v8::FunctionTemplate>(CreateSharded);
+  create_tpl->SetClassName(Nan::New("CreateShardedMmap").ToLocalChecked());
+  Nan::Set(target, Nan::New("CreateSharded").ToLocalChecked(), init_methods(create_tpl));
+
+  v8::Local<v8::FunctionTemplate> open_tpl = Nan::New<v8::FunctionTemplate>(OpenSharded);
+  open_tpl->SetClassName(Nan::New("OpenShardedMmap").ToLocalChecked());
+  Nan::Set(target, Nan::New("OpenSharded").ToLocalChecked(), init_methods(open_tpl));
+
+  Nan::SetMethod(target, "shardOf", shardOf);
 }
 
 NAN_MODULE_INIT(SharedMap::Init) {
@@ -629,6 +3837,8 @@ NAN_MODULE_INIT(SharedMap::Init) {
   open_tpl->SetClassName(Nan::New("OpenMmap").ToLocalChecked());
   auto open_fun = init_methods(open_tpl);
   Nan::Set(target, Nan::New("Open").ToLocalChecked(), open_fun);
+
+  ShardedMap::Init(target, create_fun, open_fun);
 }
 
 NODE_MODULE(mmap_object, SharedMap::Init)
@@ -17,7 +17,8 @@ const BiggerKeySize = 10000
 
 const methods = ['isClosed', 'isOpen', 'close', 'valueOf', 'toString',
                  'close', 'get_free_memory', 'get_size', 'bucket_count',
-                 'max_bucket_count', 'load_factor', 'max_load_factor']
+                 'max_bucket_count', 'load_factor', 'max_load_factor', 'isData',
+                 'grow_count', 'flushed_bytes', 'flush', 'reserve', 'rehash', 'freeze']
 
 describe('mmap-object', function () {
   before(function () {
@@ -52,6 +53,17 @@ describe('mmap-object', function () {
       expect(this.shobj['one more property']).to.equal(new Array(BigKeySize).join('A bunch of strings'))
     })
 
+    it('sets properties to non-ASCII strings', function () {
+      this.shobj.accents = 'héllo wörld ✓'
+      this.shobj.long_unicode = new Array(100).join('日本語 ')
+      this.shobj.embedded_nul = 'before\u0000after'
+      this.shobj['ключ'] = 'значение'
+      expect(this.shobj.accents).to.equal('héllo wörld ✓')
+      expect(this.shobj.long_unicode).to.equal(new Array(100).join('日本語 '))
+      expect(this.shobj.embedded_nul).to.equal('before\u0000after')
+      expect(this.shobj['ключ']).to.equal('значение')
+    })
+
     it('sets properties to a number', function () {
       this.shobj.my_number_property = 12
       expect(this.shobj.my_number_property).to.equal(12)
@@ -59,6 +71,48 @@ describe('mmap-object', function () {
       expect(this.shobj['some other number property']).to.equal(0.2)
     })
 
+    it('sets properties to integers', function () {
+      this.shobj.small = 12
+      this.shobj.negative = -2147483648
+      this.shobj.large = 9007199254740991
+      this.shobj.negative_zero = -0
+      expect(this.shobj.small).to.equal(12)
+      expect(this.shobj.negative).to.equal(-2147483648)
+      expect(this.shobj.large).to.equal(9007199254740991)
+      expect(Object.is(this.shobj.negative_zero, -0)).to.be.true
+    })
+
+    it('sets properties to booleans and null', function () {
+      this.shobj.yes = true
+      this.shobj.no = false
+      this.shobj.nothing = null
+      expect(this.shobj.yes).to.equal(true)
+      expect(this.shobj.no).to.equal(false)
+      expect(this.shobj.nothing).to.be.null
+      this.shobj.yes = 'now a string'
+      expect(this.shobj.yes).to.equal('now a string')
+    })
+
+    it('throws on unsupported value types', function () {
+      const self = this
+      expect(function () {
+        self.shobj.unsupported = {}
+      }).to.throw(/Value must be a string, number, boolean, null or binary data./)
+    })
+
+    it('sets properties to binary data', function () {
+      const bytes = Buffer.from([0, 1, 2, 254, 255, 0])
+      this.shobj.buffer = bytes
+      this.shobj.typed = new Uint16Array([1, 65535])
+      this.shobj.arraybuffer = new Uint8Array([9, 8, 7]).buffer
+      this.shobj.view = Buffer.from('skip this part').subarray(5, 9)
+      expect(Buffer.isBuffer(this.shobj.buffer)).to.be.true
+      expect(this.shobj.buffer.equals(bytes)).to.be.true
+      expect(this.shobj.typed.length).to.equal(4)
+      expect(Array.from(this.shobj.arraybuffer)).to.deep.equal([9, 8, 7])
+      expect(this.shobj.view.toString()).to.equal('this')
+    })
+
     it('can delete properties', function () {
       this.shobj.should_be_deleted = 'please delete me'
       expect(this.shobj.should_be_deleted).to.equal('please delete me')
@@ -79,6 +133,13 @@ describe('mmap-object', function () {
       }
     })
 
+    it('stores keys that only resemble method names', function () {
+      for (let key of ['closed', 'isOpe', 'get_sizes', 'Close', 'valueof']) {
+        this.shobj[key] = `value of ${key}`
+        expect(this.shobj[key]).to.equal(`value of ${key}`)
+      }
+    })
+
     it('gets a property', function () {
       this.shobj.another_property = 'whateever value'
       expect(this.shobj.another_property).to.equal('whateever value')
@@ -141,10 +202,487 @@ describe('mmap-object', function () {
       const smallobj = new MmapObject.Create(filename, 1, 4, 20)
       smallobj['key'] = new Array(BigKeySize).join('big')
       expect(function () {
-        smallobj['otherkey'] = new Array(BigKeySize).join('big')
+        smallobj['otherkey'] = new Array(BigKeySize * 6).join('big')
       }).to.throw(/File grew too large./)
     })
 
+    it('grows geometrically', function () {
+      const filename = path.join(this.dir, 'grow_geometric')
+      const obj = new MmapObject.Create(filename, 500, 0, 0, {growthFactor: 2, minGrowth: 0})
+      expect(obj.grow_count()).to.equal(0)
+      const value = new Array(4096).join('x')
+      for (let i = 0; i < 1000; i++) {
+        obj[`key ${i}`] = value
+      }
+      expect(obj.grow_count()).to.be.within(1, 5)
+      expect(obj.flushed_bytes()).to.equal(0)
+      expect(obj.get_size()).to.be.above(4000000)
+      obj.close()
+    })
+
+    it('flushes on demand', function () {
+      const filename = path.join(this.dir, 'flush_me')
+      const obj = new MmapObject.Create(filename, 500)
+      obj.key = 'value'
+      obj.flush()
+      expect(obj.flushed_bytes()).to.equal(obj.get_size())
+      expect(obj.key).to.equal('value')
+      obj.close()
+      expect(function () {
+        obj.flush()
+      }).to.throw(/Attempted to flush a closed object./)
+    })
+
+    it('flushes asynchronously', function (cb) {
+      const filename = path.join(this.dir, 'flush_me_later')
+      const obj = new MmapObject.Create(filename, 500)
+      obj.key = 'value'
+      obj.flush(function (err) {
+        expect(err).to.not.be.an('error')
+        expect(obj.flushed_bytes()).to.equal(obj.get_size())
+        obj.close()
+        cb()
+      })
+    })
+
+    it('keeps writing while a flush runs', function (cb) {
+      const filename = path.join(this.dir, 'flush_and_grow')
+      const obj = new MmapObject.Create(filename, 500)
+      obj.first = 'value'
+      const size = obj.get_size()
+      obj.flush(function (err) {
+        expect(err).to.not.be.an('error')
+        expect(obj.first).to.equal('value')
+        for (let i = 0; i < 1000; i++) {
+          expect(obj['key' + i]).to.equal('value ' + i)
+        }
+        obj.close()
+        cb()
+      })
+      for (let i = 0; i < 1000; i++) {
+        obj['key' + i] = 'value ' + i
+      }
+      expect(obj.get_size()).to.be.above(size)
+    })
+
+    it('grows by at least minGrowth', function () {
+      const filename = path.join(this.dir, 'grow_step')
+      const obj = new MmapObject.Create(filename, 500, 0, 0, {growthFactor: 1, minGrowth: 2048})
+      obj.key = new Array(BigKeySize * 200).join('big')
+      expect(obj.grow_count()).to.equal(1)
+      expect(fs.statSync(filename)['size']).to.be.at.least((500 + 2048) * 1024)
+      obj.close()
+    })
+
+    it('plans growth from the size of an existing file', function () {
+      const filename = path.join(this.dir, 'grow_existing')
+      const value = new Array(4096).join('x')
+      const first = new MmapObject.Create(filename)
+      for (let i = 0; i < 500; i++) {
+        first[`key ${i}`] = value
+      }
+      first.close()
+      const size = fs.statSync(filename)['size']
+      const obj = new MmapObject.Create(filename, 1, 0, Math.ceil(size / 1024) + 64)
+      expect(function () {
+        for (let i = 0; i < 100; i++) {
+          obj[`more ${i}`] = value
+        }
+      }).to.throw(/File grew too large./)
+      expect(fs.statSync(filename)['size']).to.be.at.most(size + 64 * 1024)
+      obj.close()
+    })
+
+    it('grows in place into reserved address space', function () {
+      const filename = path.join(this.dir, 'grow_reserved')
+      const obj = new MmapObject.Create(filename, 500, 0, 20000, {reserveAddressSpace: true})
+      const value = new Array(4096).join('x')
+      for (let i = 0; i < 1000; i++) {
+        obj[`key ${i}`] = `${i} ${value}`
+      }
+      expect(obj.grow_count()).to.be.above(0)
+      expect(obj['key 0']).to.equal(`0 ${value}`)
+      expect(obj['key 999']).to.equal(`999 ${value}`)
+      obj.close()
+      const reader = new MmapObject.Open(filename)
+      expect(Object.keys(reader)).to.have.lengthOf(1000)
+      expect(reader['key 500']).to.equal(`500 ${value}`)
+      reader.close()
+    })
+
+    it('rejects a bad growth policy', function () {
+      const filename = path.join(this.dir, 'grow_bad')
+      expect(function () {
+        return new MmapObject.Create(filename, 500, 0, 0, {growthFactor: 0.5})
+      }).to.throw(/growthFactor must be a number of at least 1./)
+    })
+
+    it('returns storage to the file after set/delete cycles', function () {
+      this.shobj.warmup = 'allocates the bucket array'
+      delete this.shobj.warmup
+      const baseline = this.shobj.get_free_memory()
+      for (let i = 0; i < 200; i++) {
+        this.shobj[`a key long enough to need its own storage ${i}`] = new Array(100).join(`value ${i}`)
+        this.shobj.counter = `overwritten value number ${i} that is also long`
+        this.shobj.number = i
+      }
+      for (let i = 0; i < 200; i++) {
+        delete this.shobj[`a key long enough to need its own storage ${i}`]
+      }
+      delete this.shobj.counter
+      delete this.shobj.number
+      expect(this.shobj.get_free_memory()).to.equal(baseline)
+    })
+
+    it('overwrites values in place', function () {
+      this.shobj.status = new Array(100).join('running ')
+      const before = this.shobj.get_free_memory()
+      this.shobj.status = new Array(50).join('stopped ')
+      expect(this.shobj.status).to.equal(new Array(50).join('stopped '))
+      expect(this.shobj.get_free_memory()).to.equal(before)
+      this.shobj.status = 42
+      expect(this.shobj.status).to.equal(42)
+      this.shobj.status = 'back to a string'
+      expect(this.shobj.status).to.equal('back to a string')
+    })
+
+    it('sets many properties from an object', function () {
+      this.shobj.setMany({ one: 'first', two: 2, three: true, four: null })
+      expect(this.shobj.one).to.equal('first')
+      expect(this.shobj.two).to.equal(2)
+      expect(this.shobj.three).to.equal(true)
+      expect(this.shobj.four).to.be.null
+    })
+
+    it('sets many properties from a Map and from arrays', function () {
+      this.shobj.setMany(new Map([['map key', 'map value'], [5, 'numeric key']]))
+      this.shobj.setMany([['pair key', 'pair value']])
+      this.shobj.setMany(['flat key', 'flat value', 'other flat key', 3.5])
+      expect(this.shobj['map key']).to.equal('map value')
+      expect(this.shobj[5]).to.equal('numeric key')
+      expect(this.shobj['pair key']).to.equal('pair value')
+      expect(this.shobj['flat key']).to.equal('flat value')
+      expect(this.shobj['other flat key']).to.equal(3.5)
+    })
+
+    it('grows a small file to fit a big batch', function () {
+      const filename = path.join(this.dir, 'set_many_grow')
+      const obj = new MmapObject.Create(filename, 1)
+      const batch = {}
+      for (let i = 0; i < 5000; i++) {
+        batch[`batch key ${i}`] = `batch value ${i}`
+      }
+      obj.setMany(batch)
+      expect(obj['batch key 0']).to.equal('batch value 0')
+      expect(obj['batch key 4999']).to.equal('batch value 4999')
+      expect(Object.keys(obj).length).to.equal(5000)
+      obj.close()
+    })
+
+    it('writes nothing from a batch with a bad value', function () {
+      const self = this
+      expect(function () {
+        self.shobj.setMany({ good: 'value', bad: {} })
+      }).to.throw(/Value must be a string, number, boolean, null or binary data./)
+      expect(this.shobj.good).to.be.undefined
+    })
+
+    it('throws for malformed pairs and keys or getters that throw', function () {
+      const self = this
+      expect(function () {
+        self.shobj.setMany([['paired', 1], 'unpaired'])
+      }).to.throw(/setMany needs every pair to be a \[key, value\] array./)
+      expect(function () {
+        self.shobj.setMany([['paired', 1], null])
+      }).to.throw(/setMany needs every pair to be a \[key, value\] array./)
+      const badKey = { toString: function () { throw new Error('bad key') } }
+      expect(function () {
+        self.shobj.setMany(new Map([['paired', 1], [badKey, 2]]))
+      }).to.throw(/bad key/)
+      expect(function () {
+        self.shobj.setMany({ paired: 1, get bad () { throw new Error('bad getter') } })
+      }).to.throw(/bad getter/)
+      expect(this.shobj.paired).to.be.undefined
+    })
+
+    it('gets many properties at once', function () {
+      this.shobj.setMany({ a: 'first', b: 2, c: false, d: Buffer.from('bytes') })
+      const values = this.shobj.getMany(['a', 'b', 'missing', 'c', 'd'])
+      expect(values).to.have.lengthOf(5)
+      expect(values.slice(0, 4)).to.deep.equal(['first', 2, undefined, false])
+      expect(values[4].toString()).to.equal('bytes')
+    })
+
+    it('reserves room for keys and bytes up front', function () {
+      const filename = path.join(this.dir, 'reserve_me')
+      const obj = new MmapObject.Create(filename, 500, 0, 0, {minGrowth: 0})
+      obj.reserve(10000, 100000)
+      expect(obj.grow_count()).to.equal(1)
+      const buckets = obj.bucket_count()
+      expect(buckets).to.be.at.least(10000)
+      for (let i = 0; i < 10000; i++) {
+        obj[`key ${i}`] = `value ${i}`
+      }
+      expect(obj.grow_count()).to.equal(1)
+      expect(obj.bucket_count()).to.equal(buckets)
+      obj.close()
+    })
+
+    it('stores properties in a flat table', function () {
+      const filename = path.join(this.dir, 'flat_table')
+      const obj = new MmapObject.Create(filename, 500, 16, 0, {table: 'flat'})
+      for (let i = 0; i < 5000; i++) {
+        obj[`key ${i}`] = i % 2 ? `value ${i}` : i
+      }
+      obj.short = 'overwritten'
+      obj.short = new Array(100).join('longer value ')
+      obj.flag = true
+      obj.nothing = null
+      obj.blob = Buffer.from('flat bytes')
+      for (let i = 0; i < 5000; i += 3) {
+        delete obj[`key ${i}`]
+      }
+      expect(obj['key 1']).to.equal('value 1')
+      expect(obj['key 2']).to.equal(2)
+      expect(obj['key 3']).to.be.undefined
+      expect(obj.short).to.equal(new Array(100).join('longer value '))
+      expect(Object.keys(obj)).to.have.lengthOf(5000 - 1667 + 4)
+      expect(obj.load_factor()).to.be.at.most(obj.max_load_factor())
+      obj.close()
+
+      const reader = new MmapObject.Open(filename)
+      expect(reader['key 4999']).to.equal('value 4999')
+      expect(reader['key 3']).to.be.undefined
+      expect(reader.getMany(['key 1', 'key 3', 'flag', 'nothing'])).to.deep.equal(
+        ['value 1', undefined, true, null])
+      expect(reader.blob.toString()).to.equal('flat bytes')
+      expect(Object.keys(reader)).to.have.lengthOf(5000 - 1667 + 4)
+      reader.close()
+    })
+
+    it('rejects an unknown table type', function () {
+      const filename = path.join(this.dir, 'bad_table')
+      expect(function () {
+        return new MmapObject.Create(filename, 500, 0, 0, {table: 'round'})
+      }).to.throw(/table must be 'chained' or 'flat'./)
+    })
+
+    it('interns repeated string values', function () {
+      const value = function (i) {
+        return `a long value shared by many keys, number ${i % 10}`
+      }
+      const filename = path.join(this.dir, 'interned')
+      const interned = new MmapObject.Create(filename, 500, 0, 0, {internStrings: true})
+      const plain = new MmapObject.Create(path.join(this.dir, 'not_interned'), 500)
+      for (let i = 0; i < 1000; i++) {
+        interned[`key ${i}`] = value(i)
+        plain[`key ${i}`] = value(i)
+      }
+      expect(interned.get_free_memory()).to.be.above(plain.get_free_memory())
+      interned['key 0'] = 'short'
+      interned['key 1'] = value(2)
+      delete interned['key 3']
+      expect(interned['key 1']).to.equal(value(2))
+      expect(interned['key 2']).to.equal(value(2))
+      interned.close()
+      plain.close()
+
+      const reader = new MmapObject.Open(filename)
+      expect(reader['key 0']).to.equal('short')
+      expect(reader['key 1']).to.equal(value(2))
+      expect(reader['key 3']).to.be.undefined
+      expect(reader['key 999']).to.equal(value(9))
+      reader.close()
+    })
+
+    it('compresses long string values', function () {
+      const doc = function (i) {
+        return JSON.stringify({id: i, status: 'active', tags: new Array(20).join('tag,'), note: 'caf\u00e9'})
+      }
+      const filename = path.join(this.dir, 'compressed')
+      const options = {compressAbove: 64, compressionDictionary: '{"status":"active","tags":"'}
+      const compressed = new MmapObject.Create(filename, 500, 0, 0, options)
+      const plain = new MmapObject.Create(path.join(this.dir, 'not_compressed'), 500)
+      for (let i = 0; i < 1000; i++) {
+        compressed[`key ${i}`] = doc(i)
+        plain[`key ${i}`] = doc(i)
+      }
+      compressed.short = 'short'
+      compressed.ascii = new Array(100).join('ascii ')
+      expect(compressed.get_free_memory()).to.be.above(plain.get_free_memory())
+      expect(compressed['key 5']).to.equal(doc(5))
+      expect(compressed.ascii).to.equal(new Array(100).join('ascii '))
+      expect(compressed.getMany(['key 6', 'short'])).to.deep.equal([doc(6), 'short'])
+      compressed.close()
+      plain.close()
+
+      const reader = new MmapObject.Open(filename)
+      expect(reader['key 999']).to.equal(doc(999))
+      reader.close()
+
+      const writer = new MmapObject.Create(filename)
+      writer['key 1000'] = doc(1000)
+      writer.close({compact: true})
+      const frozen = new MmapObject.Open(filename)
+      expect(frozen['key 0']).to.equal(doc(0))
+      expect(frozen['key 1000']).to.equal(doc(1000))
+      expect(frozen.short).to.equal('short')
+      frozen.close()
+    })
+
+    it('rejects bad compression options', function () {
+      const filename = path.join(this.dir, 'bad_compression')
+      expect(function () {
+        return new MmapObject.Create(filename, 500, 0, 0, {compressAbove: -1})
+      }).to.throw(/compressAbove must be a non-negative number./)
+      expect(function () {
+        return new MmapObject.Create(filename, 500, 0, 0, {compressAbove: 10, compressionDictionary: 5})
+      }).to.throw(/compressionDictionary must be a string or binary data./)
+    })
+
+    it('shares a concurrent file between writers', function () {
+      const filename = path.join(this.dir, 'concurrent')
+      const first = new MmapObject.Create(filename, 500, 0, 0, {concurrent: true})
+      const second = new MmapObject.Create(filename, 500, 0, 0, {concurrent: true})
+      const reader = new MmapObject.Open(filename)
+      first.one = 'from first'
+      second.two = 'from second'
+      expect(second.one).to.equal('from first')
+      expect(first.two).to.equal('from second')
+      const size = first.get_size()
+      for (let i = 0; i < 5000; i++) {
+        second[`key ${i}`] = new Array(20).join(`value ${i}`)
+      }
+      expect(first.get_size()).to.be.above(size)
+      expect(first['key 4999']).to.equal(new Array(20).join('value 4999'))
+      delete first['key 0']
+      expect(second['key 0']).to.be.undefined
+      expect(reader['key 500']).to.equal(new Array(20).join('value 500'))
+      expect(reader.two).to.equal('from second')
+      expect(function () {
+        first.close({compact: true})
+      }).to.throw(/Concurrent objects can't be compacted./)
+      first.close()
+      second.close()
+      reader.close()
+    })
+
+    it('lets Open read a live file as it is written', function () {
+      const filename = path.join(this.dir, 'live')
+      const writer = new MmapObject.Create(filename, 500, 0, 0, {live: true})
+      writer.first = 'first value'
+      const reader = new MmapObject.Open(filename)
+      expect(reader.first).to.equal('first value')
+      writer.first = 'changed'
+      writer.number = 12
+      const size = writer.get_size()
+      for (let i = 0; i < 5000; i++) {
+        writer[`key ${i}`] = new Array(20).join(`value ${i}`)
+      }
+      expect(writer.get_size()).to.be.above(size)
+      expect(reader.first).to.equal('changed')
+      expect(reader.number).to.equal(12)
+      expect(reader['key 4999']).to.equal(new Array(20).join('value 4999'))
+      delete writer['key 0']
+      expect(reader['key 0']).to.be.undefined
+      expect(reader.getMany(['first', 'key 0'])).to.deep.equal(['changed', undefined])
+      expect(Object.keys(reader)).to.have.lengthOf(5001)
+      expect(function () {
+        return new MmapObject.Create(filename, 500, 0, 0, {live: true})
+      }).to.throw(/it already has a live writer./)
+      expect(function () {
+        writer.close({compact: true})
+      }).to.throw(/Live objects can't be compacted./)
+      writer.close()
+      reader.close()
+    })
+
+    it('lets another process read a live file that grows after it opened', function (done) {
+      this.timeout(30000)
+      const filename = path.join(this.dir, 'live_across')
+      const writer = new MmapObject.Create(filename, 500, 0, 0, {live: true})
+      writer.first = 'first value'
+      process.env.TESTFILE = filename
+      const child = child_process.fork('./test/util-live-reader.js')
+      child.on('message', function () {
+        const size = writer.get_size()
+        const buckets = writer.bucket_count()
+        for (let i = 0; i < 5000; i++) {
+          writer[`key ${i}`] = new Array(20).join(`value ${i}`)
+        }
+        writer.rehash(writer.bucket_count() * 2)
+        delete writer['key 0']
+        writer.first = 'changed'
+        expect(writer.get_size()).to.be.above(size)
+        expect(writer.bucket_count()).to.be.above(buckets)
+        child.send('written')
+      })
+      child.on('exit', function (exit_code) {
+        writer.close()
+        expect(child.signalCode).to.be.null
+        expect(exit_code, 'error from util-live-reader.js').to.equal(0)
+        done()
+      })
+    })
+
+    it('rejects bad live options', function () {
+      const filename = path.join(this.dir, 'bad_live')
+      expect(function () {
+        return new MmapObject.Create(filename, 500, 0, 0, {live: true, concurrent: true})
+      }).to.throw(/A file can't be both concurrent and live./)
+      expect(function () {
+        return new MmapObject.Create(filename, 500, 0, 0, {live: true, table: 'chained'})
+      }).to.throw(/Live files need the flat table./)
+    })
+
+    it('splits keys across a sharded set', function () {
+      const dir = path.join(this.dir, 'sharded')
+      const loaders = [0, 1, 2, 3].map(function (n) {
+        return new MmapObject.CreateSharded(dir, 4, 500, 0, 0, {shard: n})
+      })
+      for (let i = 0; i < 1000; i++) {
+        loaders[MmapObject.shardOf(`key ${i}`, 4)][`key ${i}`] = i
+      }
+      expect(function () {
+        loaders[(MmapObject.shardOf('stray', 4) + 1) % 4].stray = 'value'
+      }).to.throw(/belongs to shard/)
+      loaders.forEach(function (loader) {
+        expect(Object.keys(loader).length).to.be.within(150, 350)
+        loader.close()
+      })
+      expect(function () {
+        return new MmapObject.CreateSharded(dir, 8)
+      }).to.throw(/already holds 4 shards./)
+
+      const writer = new MmapObject.CreateSharded(dir, 4)
+      writer.setMany({extra: 'one', 'key 0': 'replaced'})
+      writer.close()
+      const reader = new MmapObject.OpenSharded(dir)
+      expect(reader['key 999']).to.equal(999)
+      expect(reader['key 0']).to.equal('replaced')
+      expect(reader.getMany(['extra', 'key 5', 'missing'])).to.deep.equal(['one', 5, undefined])
+      expect(Object.keys(reader)).to.have.lengthOf(1001)
+      expect(function () {
+        reader.extra = 'two'
+      }).to.throw(/Read-only object./)
+      reader.close()
+      expect(reader.isClosed()).to.be.true
+    })
+
+    it('writes nothing to any shard from a batch with a bad value', function () {
+      const writer = new MmapObject.CreateSharded(path.join(this.dir, 'sharded_bad'), 4)
+      const batch = []
+      for (let i = 0; i < 20; i++) {
+        batch.push([`key ${i}`, `value ${i}`])
+      }
+      batch.push(['bad', function () {}])
+      expect(function () {
+        writer.setMany(batch)
+      }).to.throw(/Value must be a string, number, boolean, null or binary data./)
+      expect(Object.keys(writer)).to.have.lengthOf(0)
+      writer.close()
+    })
+
     it('allows numbers as property names', function () {
       this.shobj[1] = 'what'
       expect(this.shobj[1]).to.equal('what')
@@ -194,6 +732,39 @@ describe('mmap-object', function () {
       const final = this.obj.max_load_factor()
       expect(final).to.equal(1.0)
     })
+
+    it('sets max_load_factor and keeps it in the file', function () {
+      const filename = path.join(this.dir, 'load_factor_file')
+      const obj = new MmapObject.Create(filename)
+      for (let i = 0; i < 100; i++) {
+        obj[`key ${i}`] = i
+      }
+      obj.max_load_factor(0.5)
+      expect(obj.max_load_factor()).to.equal(0.5)
+      expect(obj.load_factor()).to.be.at.most(0.5)
+      expect(obj.bucket_count()).to.be.at.least(200)
+      expect(obj['key 42']).to.equal(42)
+      obj.close()
+      const reader = new MmapObject.Open(filename)
+      expect(reader.max_load_factor()).to.equal(0.5)
+      expect(reader['key 99']).to.equal(99)
+      expect(function () {
+        reader.max_load_factor(2)
+      }).to.throw(/Read-only object./)
+      reader.close()
+    })
+
+    it('rehash', function () {
+      const obj = new MmapObject.Create(path.join(this.dir, 'rehash_file'))
+      obj.one = 'value'
+      obj.rehash(4096)
+      expect(obj.bucket_count()).to.be.at.least(4096)
+      expect(obj.one).to.equal('value')
+      expect(function () {
+        obj.rehash(-1)
+      }).to.throw(/rehash needs a number of buckets./)
+      obj.close()
+    })
   })
 
   describe('Opener', function () {
@@ -206,6 +777,10 @@ describe('mmap-object', function () {
       writer[this.bigKey] = new Array(BiggerKeySize).join('six hundred seventy nine thousand nine hundred thirty two bytes long')
       writer['samekey'] = 'first value'
       writer['samekey'] = writer['samekey'] + ' and a new value too'
+      writer['blob'] = Buffer.from('binary \u0000 contents')
+      writer['flag'] = true
+      writer['nothing'] = null
+      writer['count'] = 42
       writer[12345] = 'numberkey'
       writer['12346'] = 'numberkey2'
       writer.should_be_deleted = 'I should not exist!'
@@ -280,12 +855,52 @@ describe('mmap-object', function () {
       expect(function () {
         reader.my_string_property = 'my value'
       }).to.throw(/Read-only object./)
+      expect(function () {
+        reader.reserve(100)
+      }).to.throw(/Read-only object./)
     })
 
     it('can get string properties', function () {
       expect(this.reader.first).to.equal('value for first')
     })
 
+    it('can get boolean, null and integer properties', function () {
+      expect(this.reader.flag).to.equal(true)
+      expect(this.reader.nothing).to.be.null
+      expect(this.reader.count).to.equal(42)
+    })
+
+    it('can get binary properties', function () {
+      expect(this.reader.blob.toString()).to.equal('binary \u0000 contents')
+    })
+
+    it('hands out copies of binary properties', function () {
+      const blob = this.reader.blob
+      blob[0] = 66
+      expect(this.reader.blob.toString()).to.equal('binary \u0000 contents')
+    })
+
+    it('keeps binary properties that point into the file readable after close', function () {
+      const obj = new MmapObject.Open(this.testfile, { externalBuffers: true })
+      const blob = obj.blob
+      obj.close()
+      expect(blob.toString()).to.equal('binary \u0000 contents')
+    })
+
+    it('can get many properties at once', function () {
+      expect(this.reader.getMany(['first', 'second', 12345, 'nope'])).to.deep.equal(
+        ['value for first', 0.207879576, 'numberkey', undefined])
+    })
+
+    it('can hand out strings that point into the file', function () {
+      const obj = new MmapObject.Open(this.testfile, { externalStrings: true })
+      const big = obj[this.bigKey]
+      const first = obj.first
+      obj.close()
+      expect(big).to.equal(new Array(BiggerKeySize).join('six hundred seventy nine thousand nine hundred thirty two bytes long'))
+      expect(first).to.equal('value for first')
+    })
+
     it('can set/get numeric properties', function () {
       expect(this.reader['12345']).to.equal('numberkey')
       expect(this.reader[12346]).to.equal('numberkey2')
@@ -299,7 +914,8 @@ describe('mmap-object', function () {
     })
 
     it('can get keys', function () {
-      expect(this.reader).to.have.keys(['first', 'second', this.bigKey, '12345', '12346', 'samekey'])
+      expect(this.reader).to.have.keys(['first', 'second', this.bigKey, '12345', '12346', 'samekey',
+                                        'blob', 'flag', 'nothing', 'count'])
     })
 
     it('has enumerable but read-only properties', function () {
@@ -397,6 +1013,199 @@ describe('mmap-object', function () {
     })
   })
 
+  describe('Frozen files', function () {
+    before(function () {
+      this.plainfile = path.join(this.dir, 'plaintest')
+      this.frozenfile = path.join(this.dir, 'frozentest')
+      this.longValue = new Array(200).join('long ascii value ')
+      const self = this
+      function write (filename, options) {
+        const writer = new MmapObject.Create(filename)
+        for (let i = 0; i < 1000; i++) {
+          writer[`key ${i}`] = `value ${i}`
+        }
+        writer.text = 'non-ASCII \u00e9t\u00e9'
+        writer.long = self.longValue
+        writer.number = 0.207879576
+        writer.integer = -42
+        writer.flag = false
+        writer.nothing = null
+        writer.blob = Buffer.from('frozen \u0000 bytes')
+        writer.close(options)
+      }
+      this.perfectfile = path.join(this.dir, 'perfecttest')
+      write(this.plainfile)
+      write(this.frozenfile, {compact: true})
+      write(this.perfectfile, {compact: true, perfectHash: true})
+      this.reader = new MmapObject.Open(this.frozenfile)
+    })
+
+    after(function () {
+      this.reader.close()
+    })
+
+    it('are smaller than the file they came from', function () {
+      expect(fs.statSync(this.frozenfile).size).to.be.below(fs.statSync(this.plainfile).size)
+      expect(this.reader.get_size()).to.equal(fs.statSync(this.frozenfile).size)
+      expect(this.reader.get_free_memory()).to.equal(0)
+    })
+
+    it('read back every kind of value', function () {
+      expect(this.reader['key 0']).to.equal('value 0')
+      expect(this.reader['key 999']).to.equal('value 999')
+      expect(this.reader['key 1000']).to.be.undefined
+      expect(this.reader.text).to.equal('non-ASCII \u00e9t\u00e9')
+      expect(this.reader.long).to.equal(this.longValue)
+      expect(this.reader.number).to.equal(0.207879576)
+      expect(this.reader.integer).to.equal(-42)
+      expect(this.reader.flag).to.be.false
+      expect(this.reader.nothing).to.be.null
+      expect(this.reader.blob.toString()).to.equal('frozen \u0000 bytes')
+      expect(Object.keys(this.reader)).to.have.lengthOf(1007)
+      expect(this.reader.getMany(['key 5', 'missing', 'flag'])).to.deep.equal(['value 5', undefined, false])
+    })
+
+    it('can hand out strings that point into the file', function () {
+      const reader = new MmapObject.Open(this.frozenfile, {externalStrings: true})
+      const long = reader.long
+      reader.close()
+      expect(long).to.equal(this.longValue)
+    })
+
+    it('are read-only', function () {
+      const reader = this.reader
+      expect(function () {
+        reader.number = 1
+      }).to.throw(/Read-only object./)
+      expect(function () {
+        reader.close({compact: true})
+      }).to.throw(/Only objects from Create can be compacted./)
+      const frozenfile = this.frozenfile
+      expect(function () {
+        return new MmapObject.Create(frozenfile)
+      }).to.throw(/frozen files are read-only./)
+    })
+
+    it('can be indexed with a perfect hash', function () {
+      expect(fs.statSync(this.perfectfile).size).to.be.below(fs.statSync(this.frozenfile).size)
+      const reader = new MmapObject.Open(this.perfectfile)
+      for (let i = 0; i < 1000; i++) {
+        expect(reader[`key ${i}`]).to.equal(`value ${i}`)
+      }
+      expect(reader['key 1000']).to.be.undefined
+      expect(reader.long).to.equal(this.longValue)
+      expect(reader.blob.toString()).to.equal('frozen \u0000 bytes')
+      expect(reader.getMany(['key 5', 'missing', 'flag'])).to.deep.equal(['value 5', undefined, false])
+      expect(Object.keys(reader)).to.have.lengthOf(1007)
+      expect(reader.bucket_count()).to.be.at.least(1007)
+      reader.close()
+    })
+
+    it('read back keys and values on either side of the inline size', function () {
+      const filename = path.join(this.dir, 'inlinetest')
+      const writer = new MmapObject.Create(filename)
+      writer.empty = ''
+      writer['8 bytes!'] = '12345678'
+      writer['nine byte'] = '123456789'
+      writer.buffer = Buffer.from('12345678')
+      writer.close({compact: true})
+      const reader = new MmapObject.Open(filename)
+      expect(reader.empty).to.equal('')
+      expect(reader['8 bytes!']).to.equal('12345678')
+      expect(reader['nine byte']).to.equal('123456789')
+      expect(reader.buffer.toString()).to.equal('12345678')
+      expect(Object.keys(reader).sort()).to.deep.equal(['8 bytes!', 'buffer', 'empty', 'nine byte'])
+      reader.close()
+    })
+
+    it('throw when an entry read points past the end', function () {
+      const filename = path.join(this.dir, 'frozencorrupt')
+      const bytes = fs.readFileSync(this.frozenfile)
+      const entries = bytes.readUInt32LE(32)
+      // Move every value offset far past the end of the file.
+      for (let i = 0; i < bytes.readUInt32LE(16); i++) {
+        bytes.writeUInt32LE(0xffffffff, entries + i * 40 + 36)
+      }
+      fs.writeFileSync(filename, bytes)
+      const reader = new MmapObject.Open(filename)
+      expect(reader.integer).to.equal(-42)
+      expect(function () {
+        return reader.long
+      }).to.throw(/Frozen file appears to be corrupt./)
+      expect(function () {
+        return reader.getMany(['integer', 'long'])
+      }).to.throw(/Frozen file appears to be corrupt./)
+      reader.close()
+    })
+
+    it('leave nothing behind when the frozen copy can\'t be written', function () {
+      if (os.platform() !== 'linux') {
+        return this.skip() // Needs /dev/full to fail the writes
+      }
+      const filename = path.join(this.dir, 'fullfreeze')
+      const writer = new MmapObject.Create(filename)
+      writer.only = 'value'
+      fs.symlinkSync('/dev/full', filename + '.frozen')
+      expect(function () {
+        writer.close({compact: true})
+      }).to.throw(/Can't write .*fullfreeze.frozen/)
+      expect(fs.existsSync(filename + '.frozen')).to.be.false
+      expect(writer.isOpen()).to.be.true
+      expect(writer.only).to.equal('value')
+      writer.close()
+    })
+
+    it('can be written with freeze()', function (cb) {
+      const filename = path.join(this.dir, 'freezetest')
+      const writer = new MmapObject.Create(filename)
+      writer.only = 'value'
+      writer.freeze(function (err) {
+        expect(err).to.not.be.an('error')
+        const reader = new MmapObject.Open(filename)
+        expect(reader.only).to.equal('value')
+        expect(Object.keys(reader)).to.deep.equal(['only'])
+        reader.close()
+        cb()
+      })
+    })
+
+    it('refuse writes while compacting in the background', function (cb) {
+      const filename = path.join(this.dir, 'closingtest')
+      const writer = new MmapObject.Create(filename)
+      writer.only = 'value'
+      writer.close({compact: true}, function (err) {
+        expect(err).to.not.be.an('error')
+        const reader = new MmapObject.Open(filename)
+        expect(Object.keys(reader)).to.deep.equal(['only'])
+        reader.close()
+        cb()
+      })
+      expect(function () {
+        writer.other = 'value'
+      }).to.throw(/Cannot write to an object that is closing./)
+      expect(function () {
+        writer.setMany({other: 'value'})
+      }).to.throw(/Cannot write to an object that is closing./)
+      expect(function () {
+        delete writer.only
+      }).to.throw(/Cannot delete from an object that is closing./)
+      expect(function () {
+        writer.close()
+      }).to.throw(/Attempted to close an object that is already closing./)
+    })
+
+    it('can be written with freeze(options)', function () {
+      const filename = path.join(this.dir, 'freezeperfecttest')
+      const writer = new MmapObject.Create(filename)
+      writer.only = 'value'
+      writer.freeze({perfectHash: true})
+      const reader = new MmapObject.Open(filename)
+      expect(reader.only).to.equal('value')
+      expect(reader.other).to.be.undefined
+      reader.close()
+    })
+  })
+
   describe('Object comparison', function () {
     before(function () {
       const testfile1 = path.join(this.dir, 'prototest1')
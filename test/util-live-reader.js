@@ -0,0 +1,25 @@
+'use strict'
+/*
+  This is intended to run in a different process space than the main
+  tests. It opens a live file before the writer grows and rehashes it,
+  then checks that it reads what was written afterwards.
+*/
+
+const binary = require('node-pre-gyp')
+const path = require('path')
+const mmap_obj_path = binary.find(path.resolve(path.join(__dirname, '../package.json')))
+const MmapObject = require(mmap_obj_path)
+const expect = require('chai').expect
+
+const reader = new MmapObject.Open(process.env.TESTFILE)
+expect(reader.first).to.equal('first value')
+process.on('message', function () {
+  expect(reader.first).to.equal('changed')
+  expect(reader['key 0']).to.be.undefined
+  expect(reader['key 4999']).to.equal(new Array(20).join('value 4999'))
+  expect(reader.getMany(['key 1', 'missing'])).to.deep.equal([new Array(20).join('value 1'), undefined])
+  expect(Object.keys(reader)).to.have.lengthOf(5000)
+  reader.close()
+  process.disconnect()
+})
+process.send('opened')